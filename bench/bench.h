@@ -0,0 +1,46 @@
+#ifndef BENCH_H
+#define BENCH_H
+
+// What every benchmark shares: a clock for timing its workload and the
+// verdict of its own checks, which becomes the exit status so that a
+// wrong result fails `make bench`. Each bench is a single file.
+#include <stdbool.h>
+#include <stdio.h>
+#include <time.h>
+
+// checks that failed so far
+static int bench_failures;
+
+// CLOCK_MONOTONIC in seconds
+static inline double bench_now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// Count a failed check and flag it, as "(what)", on the result line
+// being printed. Returns ok
+static inline bool bench_check(bool ok, const char *what)
+{
+	if (!ok) {
+		printf("  (%s)", what);
+		bench_failures++;
+	}
+	return ok;
+}
+
+// Count a case that could not even be set up
+static inline void bench_fail(const char *name, const char *why)
+{
+	fprintf(stderr, "%s: %s\n", name, why);
+	bench_failures++;
+}
+
+// main's return value
+static inline int bench_status(void)
+{
+	return bench_failures ? 1 : 0;
+}
+
+#endif // BENCH_H
@@ -0,0 +1,119 @@
+// 324CC Stefan CALMAC
+// Journal throughput: appending publish-sized records in batches under
+// each sync policy, then replaying them for one client and for all.
+// Run from a directory on the disk the broker would journal to.
+#define _GNU_SOURCE // mkdtemp
+#include <dirent.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../include/journal.h"
+#include "bench.h"
+
+#define RECORDS 100000
+#define BATCH 32
+#define PAYLOAD 100
+#define CLIENTS 8
+#define SEGMENT (16 << 20)
+#define INTERVAL_MS 10
+
+static int count_frame(void *arg, const void *data, uint32_t len)
+{
+	(void)data;
+	((unsigned long *)arg)[0]++;
+	((unsigned long *)arg)[1] += len;
+	return 0;
+}
+
+// replay id's records from pos to the end of the log
+static void replay_all_of(journal_t *j, journal_pos_t pos, const char *id,
+						  unsigned long *counts)
+{
+	while (pos.seg)
+		journal_replay(j, &pos, id, count_frame, counts);
+}
+
+static void remove_dir(const char *dir)
+{
+	DIR *d = opendir(dir);
+	if (!d)
+		return;
+	struct dirent *e;
+	while ((e = readdir(d))) {
+		char path[512];
+		if (e->d_name[0] == '.')
+			continue;
+		snprintf(path, sizeof(path), "%s/%s", dir, e->d_name);
+		unlink(path);
+	}
+	closedir(d);
+	rmdir(dir);
+}
+
+// the replays must give back every record
+static void run_case(const char *name, journal_sync_t sync)
+{
+	char dir[] = "journal_bench.XXXXXX";
+	journal_t j;
+	if (!mkdtemp(dir) ||
+		journal_open(&j, dir, SEGMENT, sync, INTERVAL_MS, NULL, NULL) < 0) {
+		bench_fail(name, "setup failed");
+		return;
+	}
+
+	char ids[CLIENTS][JOURNAL_ID_LEN];
+	for (int i = 0; i < CLIENTS; i++)
+		snprintf(ids[i], sizeof(ids[i]), "client%d", i);
+	char frame[PAYLOAD];
+	memset(frame, 'x', sizeof(frame));
+	struct iovec iov = {frame, sizeof(frame)};
+
+	// each record for one client, round-robin; a cursor on the first
+	// record keeps every segment alive for the replay
+	journal_pos_t first = {0, 0};
+	double t0 = bench_now();
+	for (int i = 0; i < RECORDS; i += BATCH) {
+		journal_lock(&j);
+		for (int k = i; k < i + BATCH && k < RECORDS; k++) {
+			const char *id = ids[k % CLIENTS];
+			journal_pos_t pos = journal_append(&j, &iov, 1, &id, 1);
+			if (!first.seg) {
+				first = pos;
+				journal_cursor_add(&j, pos);
+			}
+		}
+		journal_unlock(&j);
+		journal_sync(&j);
+	}
+	double append = bench_now() - t0;
+
+	unsigned long one[2] = {0, 0}, all[2] = {0, 0};
+	journal_lock(&j);
+	t0 = bench_now();
+	replay_all_of(&j, first, ids[0], one);
+	double replay_one = bench_now() - t0;
+	t0 = bench_now();
+	for (int i = 0; i < CLIENTS; i++)
+		replay_all_of(&j, first, ids[i], all);
+	double replay_all = bench_now() - t0;
+	journal_unlock(&j);
+
+	printf("%-9s append %8.0f rec/s %7.1f MB/s (%lu syncs) | "
+		   "replay 1 client %8.0f rec/s, %d clients %8.0f rec/s",
+		   name, RECORDS / append, j.appended_bytes / append / 1e6, j.syncs,
+		   one[0] / replay_one, CLIENTS, all[0] / replay_all);
+	bench_check(all[0] == RECORDS, "WRONG");
+	putchar('\n');
+
+	journal_close(&j);
+	remove_dir(dir);
+}
+
+int main(void)
+{
+	run_case("none", JOURNAL_SYNC_NONE);
+	run_case("interval", JOURNAL_SYNC_INTERVAL);
+	run_case("batch", JOURNAL_SYNC_BATCH);
+	return bench_status();
+}
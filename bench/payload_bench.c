@@ -0,0 +1,246 @@
+// 324CC Stefan CALMAC
+// Subscriber value rendering: every datagram of a udp_client corpus
+// (JSON with base64 payloads) decoded and formatted as "topic - TYPE -
+// value", by the printf-based decoder the subscriber used to have and
+// by payload_format(). Both write through a fully buffered stream to
+// /dev/null; the outputs are compared once beforehand, and any
+// difference makes the exit status non-zero.
+#define _GNU_SOURCE // open_memstream
+#include <stdlib.h>
+#include <string.h>
+
+#include "../include/payload.h"
+#include "../include/protocol.h"
+#include "bench.h"
+
+#define ROUNDS 100000
+#define MAX_DATAGRAMS 1024
+
+typedef struct {
+	char *data;
+	size_t len;
+} datagram_t;
+
+// the subscriber's decoder before payload_format, printing to out
+static void legacy_process_payload(FILE *out, char *payload, size_t len)
+{
+	if (len < 1)
+		return;
+	uint8_t type = payload[0];
+	const char *p = payload + 1;
+	size_t remain = len - 1;
+
+	switch (type) {
+	case 0: {
+		if (remain < 5)
+			return;
+		uint8_t sign = p[0];
+		uint32_t netv;
+		memcpy(&netv, p + 1, 4);
+		uint32_t v = ntohl(netv);
+		if (sign)
+			v = -v;
+		fprintf(out, "INT - %d\n", v);
+		break;
+	}
+	case 1: {
+		if (remain < 2)
+			return;
+		uint16_t netsh;
+		memcpy(&netsh, p, 2);
+		fprintf(out, "SHORT_REAL - %.2f\n", ntohs(netsh) / 100.0);
+		break;
+	}
+	case 2: {
+		if (remain < 6)
+			return;
+		uint8_t sign = p[0];
+		uint32_t netm;
+		memcpy(&netm, p + 1, 4);
+		uint8_t exp = p[5];
+		double val = (double)ntohl(netm);
+		for (int i = 0; i < exp; i++)
+			val /= 10.0;
+		if (sign)
+			val = -val;
+		fprintf(out, "FLOAT - %.*f\n", exp, val);
+		break;
+	}
+	case 3: {
+		size_t sl = strnlen(p, remain);
+		char *s = malloc(sl + 1);
+		memcpy(s, p, sl);
+		s[sl] = '\0';
+		fprintf(out, "STRING - %s\n", s);
+		free(s);
+		break;
+	}
+	}
+}
+
+static void legacy_render(FILE *out, const datagram_t *d)
+{
+	char topic[MAX_TOPIC_LEN + 1];
+	memcpy(topic, d->data, MAX_TOPIC_LEN);
+	topic[MAX_TOPIC_LEN] = '\0';
+	fprintf(out, "%s - ", topic);
+	legacy_process_payload(out, d->data + MAX_TOPIC_LEN,
+						   d->len - MAX_TOPIC_LEN);
+}
+
+static void fast_render(FILE *out, char *line, const datagram_t *d)
+{
+	size_t tlen = strnlen(d->data, MAX_TOPIC_LEN);
+	memcpy(line, d->data, tlen);
+	memcpy(line + tlen, " - ", 3);
+	const char *err;
+	int n = payload_format(line + tlen + 3, d->data + MAX_TOPIC_LEN,
+						   d->len - MAX_TOPIC_LEN, &err);
+	if (n > 0)
+		fwrite(line, 1, tlen + 3 + n, out);
+}
+
+static int b64_value(char c)
+{
+	if (c >= 'A' && c <= 'Z')
+		return c - 'A';
+	if (c >= 'a' && c <= 'z')
+		return c - 'a' + 26;
+	if (c >= '0' && c <= '9')
+		return c - '0' + 52;
+	if (c == '+')
+		return 62;
+	if (c == '/')
+		return 63;
+	return -1;
+}
+
+// decode s[0..len) into out; returns the decoded length
+static size_t b64_decode(const char *s, size_t len, char *out)
+{
+	size_t n = 0;
+	unsigned int acc = 0, bits = 0;
+	for (size_t i = 0; i < len; i++) {
+		int v = b64_value(s[i]);
+		if (v < 0)
+			continue;
+		acc = acc << 6 | v;
+		bits += 6;
+		if (bits >= 8) {
+			bits -= 8;
+			out[n++] = acc >> bits;
+		}
+	}
+	return n;
+}
+
+// every "payload_base64" string of the corpus with a topic field and a
+// value; returns how many were loaded, -1 on error
+static int load_corpus(const char *path, datagram_t *out)
+{
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+	fseek(f, 0, SEEK_END);
+	long size = ftell(f);
+	rewind(f);
+	char *json = malloc(size + 1);
+	if (!json || fread(json, 1, size, f) != (size_t)size) {
+		fclose(f);
+		free(json);
+		return -1;
+	}
+	fclose(f);
+	json[size] = '\0';
+
+	int n = 0;
+	const char *key = "\"payload_base64\"";
+	for (char *p = strstr(json, key); p && n < MAX_DATAGRAMS;
+		 p = strstr(p, key)) {
+		p = strchr(p + strlen(key), '"');
+		char *end = p ? strchr(p + 1, '"') : NULL;
+		if (!end)
+			break;
+		char *data = malloc(end - p);
+		size_t len = b64_decode(p + 1, end - p - 1, data);
+		if (len > MAX_TOPIC_LEN) {
+			out[n].data = data;
+			out[n++].len = len;
+		} else {
+			free(data);
+		}
+		p = end + 1;
+	}
+	free(json);
+	return n;
+}
+
+int main(int argc, char *argv[])
+{
+	const char *path = argc > 1 ? argv[1]
+								: "pcom_hw2_udp_client/sample_payloads.json";
+	static datagram_t corpus[MAX_DATAGRAMS];
+	int n = load_corpus(path, corpus);
+	if (n <= 0) {
+		fprintf(stderr, "%s: no payloads\n", path);
+		return 1;
+	}
+	static char line[MAX_TOPIC_LEN + 3 + MAX_UDP_PAYLOAD + PAYLOAD_TEXT_ROOM];
+
+	// same text from both, datagram by datagram
+	int mismatches = 0;
+	for (int i = 0; i < n; i++) {
+		char *a, *b;
+		size_t alen, blen;
+		FILE *fa = open_memstream(&a, &alen);
+		FILE *fb = open_memstream(&b, &blen);
+		legacy_render(fa, &corpus[i]);
+		fast_render(fb, line, &corpus[i]);
+		fclose(fa);
+		fclose(fb);
+		if (alen != blen || memcmp(a, b, alen)) {
+			fprintf(stderr, "mismatch: %.*s vs %.*s", (int)alen, a,
+					(int)blen, b);
+			mismatches++;
+		}
+		free(a);
+		free(b);
+	}
+
+	FILE *null = fopen("/dev/null", "w");
+	if (!null) {
+		perror("/dev/null");
+		return 1;
+	}
+	setvbuf(null, NULL, _IOFBF, 1 << 16);
+
+	double t0 = bench_now();
+	for (int r = 0; r < ROUNDS; r++)
+		for (int i = 0; i < n; i++)
+			legacy_render(null, &corpus[i]);
+	fflush(null);
+	double legacy = bench_now() - t0;
+
+	t0 = bench_now();
+	for (int r = 0; r < ROUNDS; r++)
+		for (int i = 0; i < n; i++)
+			fast_render(null, line, &corpus[i]);
+	fflush(null);
+	double fast = bench_now() - t0;
+
+	double msgs = (double)ROUNDS * n;
+	printf("%d payloads x %d rounds\n", n, ROUNDS);
+	printf("printf decoder   %8.2f Mmsg/s\n", msgs / legacy / 1e6);
+	printf("payload_format   %8.2f Mmsg/s  (%.1fx)", msgs / fast / 1e6,
+		   legacy / fast);
+	// a formatter regression fails make bench
+	bench_check(!mismatches, "OUTPUT DIFFERS");
+	putchar('\n');
+
+	fclose(null);
+	for (int i = 0; i < n; i++)
+		free(corpus[i].data);
+	return bench_status();
+}
@@ -0,0 +1,103 @@
+// 324CC Stefan CALMAC
+// Adversarial '*' matching benchmark: subscriptions stacking several
+// '*' wildcards, matched against deep topics that almost fit them.
+// Without per-match memoization the walk grows like C(levels, stars);
+// here the cost per match should stay flat as stars are added. Exits
+// non-zero if a case matches wrong or a match costs over MAX_US_PER_MATCH.
+#include <string.h>
+
+#include "../include/client_server.h"
+#include "bench.h"
+
+#define ROUNDS 200
+
+// far above the memoized walk's cost (tens of us on these cases), far
+// below a naive one's (C(60, 12) ways to split 60 levels over 12 stars)
+#define MAX_US_PER_MATCH 2000.0
+
+// "seg/seg/.../seg" with n copies of seg
+static void repeat(char *out, const char *seg, int n)
+{
+	out[0] = '\0';
+	for (int i = 0; i < n; i++) {
+		if (i)
+			strcat(out, "/");
+		strcat(out, seg);
+	}
+}
+
+// time match_topic of topic against a fresh trie holding pattern,
+// which must find expect clients
+static void run_case(const char *name, const char *pattern,
+					 const char *topic, size_t expect)
+{
+	topic_node_t *root = node_create(NULL, CHILD_NAME, NULL);
+	client_t *cl = client_create("bench");
+	client_vec_t out = {0};
+
+	if (!root || !cl || trie_subscribe(root, cl, pattern, false, NULL, NULL) < 0) {
+		bench_fail(name, "setup failed");
+		return;
+	}
+
+	size_t tlen = strlen(topic);
+	double t0 = bench_now();
+	for (int i = 0; i < ROUNDS; i++)
+		match_topic(root, topic, tlen, &out);
+	double us = (bench_now() - t0) * 1e6 / ROUNDS;
+
+	printf("%-28s %8.2f us/match  matched %zu", name, us, out.n);
+	bench_check(out.n == expect, "WRONG");
+	bench_check(us <= MAX_US_PER_MATCH, "TOO SLOW");
+	putchar('\n');
+
+	// the (empty) root itself is left behind
+	client_destroy(root, cl);
+	free(out.v);
+}
+
+int main(void)
+{
+	char pattern[512], topic[512], seg[512];
+
+	printf("%d matches per case\n\n", ROUNDS);
+
+	// "*/*/.../*/z" against 60 levels of "a": never matches, and a
+	// naive walk tries every way of spreading the levels over the stars
+	for (int k = 1; k <= 12; k++) {
+		char name[64];
+		repeat(pattern, "*", k);
+		strcat(pattern, "/z");
+		repeat(topic, "a", 60);
+		snprintf(name, sizeof(name), "%d stars, miss", k);
+		run_case(name, pattern, topic, 0);
+	}
+	putchar('\n');
+
+	// "*/sensors/*/temp/*" against "sensors/temp" repeated, which every
+	// star split can line up with
+	for (int k = 1; k <= 6; k++) {
+		char name[64];
+		pattern[0] = '\0';
+		for (int i = 0; i < k; i++)
+			strcat(pattern, "*/sensors/*/temp/");
+		strcat(pattern, "*");
+		repeat(topic, "sensors/temp", 30);
+		snprintf(name, sizeof(name), "%d x */sensors/*/temp/*", k);
+		run_case(name, pattern, topic, 1);
+	}
+	putchar('\n');
+
+	// the same stacked stars, but the topic is one level short of the
+	// literal tail: every split has to be ruled out
+	for (int depth = 8; depth <= 64; depth *= 2) {
+		char name[64];
+		repeat(pattern, "*", 8);
+		strcat(pattern, "/a/a/a/b");
+		repeat(seg, "a", depth - 1);
+		snprintf(topic, sizeof(topic), "%s/c", seg);
+		snprintf(name, sizeof(name), "8 stars, %d levels", depth);
+		run_case(name, pattern, topic, 0);
+	}
+	return bench_status();
+}
@@ -1,32 +1,209 @@
 #ifndef CLIENT_H
 #define CLIENT_H
 
+#include <pthread.h>
+
 #include "topic_trie.h"
 #include "protocol.h"
+#include "journal.h"
 
 #define READ_BUF_SIZE 2048
+#define DEFAULT_OUT_HWM (1 << 20)
+// what an offline client keeps for its store-and-forward subscriptions
+#define DEFAULT_STORE_MSGS 1024
+#define DEFAULT_STORE_BYTES (1 << 20)
+// initial client registry size, doubled at 3/4 load
+#define REGISTRY_INIT 64
 
 typedef struct topic_node topic_node_t;
 typedef struct sub_ref sub_ref_t;
+struct worker;
+
+// what to do with a frame that would push a client's outbound queue
+// past its high-water mark
+typedef enum {
+	OUT_DROP_OLDEST,	// evict queued frames (never a partially sent one)
+	OUT_DROP_NEWEST,	// drop the frame being queued
+	OUT_DISCONNECT		// drop the queue and disconnect the client
+} out_policy_t;
+
+// whether a known client currently has a connection; clients are
+// never forgotten, so their subscriptions survive a reconnect
+typedef enum {
+	CLIENT_INACTIVE,
+	CLIENT_ACTIVE
+} client_state_t;
+
+// a queued reference to a shared frame, maybe partially sent
+typedef struct out_slot {
+	frame_t *frame;
+	uint32_t off;					// bytes of the frame already written
+} out_slot_t;
 
 typedef struct client {
 	int fd;							// socket
 	char id[16];					// client identifier
+	uint32_t id_hash;				// seg_hash of id, registry key
+	client_state_t state;			// set by client_attach/detach
+	pub_format_t format;			// asked for on the ID line
 	char read_buf[READ_BUF_SIZE];
 	size_t read_buf_len;			// how many bytes are in read_buf
-	struct client *next;
 
 	sub_ref_t *subscriptions;
+
+	int epfd;						// reactor reading fd
+
+	// output side: owned by the client's delivery worker if it has
+	// one, else by the reactor (then out_fd/out_epfd = fd/epfd)
+	struct worker *worker;
+	int out_fd;
+	int out_epfd;					// where EPOLLOUT is armed
+
+	// outbound queue, flushed when the socket is writable
+	out_slot_t *out_q;				// ring of queued frames
+	unsigned int out_cap;			// ring size, power of two
+	unsigned int out_first;			// index of the oldest slot
+	unsigned int out_count;			// slots in use
+	size_t out_bytes;				// unsent bytes in the queue
+	bool want_out;					// EPOLLOUT armed
+	bool closing;					// disconnect pending, queue nothing
+	bool replaying;					// journal backlog left, see client_replay
+	bool flush_pending;				// on its worker's dirty list
+	struct client *flush_next;
+
+	// store-and-forward: frames matched through an SF subscription
+	// while offline, replayed on reconnect. The lock also covers the
+	// state changes, so nothing is stored behind a replay
+	pthread_mutex_t store_lock;
+	frame_t **store_q;				// ring of frame references
+	unsigned int store_cap;			// power of two
+	unsigned int store_first;
+	unsigned int store_count;
+	size_t store_bytes;
+	journal_pos_t jcursor;			// first journal record kept for it
+
+	// per-client counters
+	unsigned long bytes_queued;
+	unsigned long bytes_dropped;
+	unsigned long msgs_dropped;
+	unsigned long msgs_stored;
+	unsigned long msgs_evicted;		// stored, then pushed out by newer ones
+	unsigned long msgs_replayed;
 } client_t;
 
-// Allocate, initialize (incl. TCP_NODELAY), return NULL on error
-client_t *client_create(int fd, const char *id);
+// Every client ever seen, by ID: open addressing with linear probing.
+// Clients are only removed at shutdown, so slots never need tombstones
+typedef struct client_registry {
+	client_t **slots;				// NULL = free
+	unsigned int cap;				// power of two
+	unsigned int count;				// clients known
+} client_registry_t;
+
+// Set the outbound high-water mark (bytes) and overflow policy
+void client_set_out_limits(size_t hwm, out_policy_t policy);
+
+// Set how many messages / bytes an offline client stores at most
+void client_set_store_limits(unsigned int msgs, size_t bytes);
+
+// Keep offline clients' frames in j instead of their RAM rings (NULL:
+// back to RAM). Only call before publishing starts
+void client_set_journal(journal_t *j);
+
+// Allocate an inactive (fd = -1) client, return NULL on error
+client_t *client_create(const char *id);
+
+// Make fd the client's socket: non-blocking, TCP_NODELAY, registered
+// with epfd (cookie = c) for input, its output side handed to the
+// client's worker if set; then replay what was stored meanwhile.
+// Returns -1 on error (fd left untouched)
+int client_attach(client_t *c, int fd, int epfd);
+
+// Unregister the socket from the reactor and close it, dropping pending
+// output (on the worker, if any); keeps subs
+void client_detach(client_t *c);
+
+// Output side of attach/detach, run by whoever owns it
+void client_out_attach(client_t *c, int fd, int out_epfd);
+void client_out_close(client_t *c);
 
-// Tear down a client (close + free)
+// Queue the next part of c's journal backlog, as much as the outbound
+// limit takes, and flush it; a restart replays it again until all of it
+// was queued. Run by the output side's owner on attach, then whenever
+// EPOLLOUT finds the socket writable while c->replaying
+void client_replay(client_t *c);
+
+// Tear down a client (close + drop stored frames + free)
 void client_destroy(topic_node_t *root, client_t *c);
 
+// Queue a reference to f and try to write it right away, or pass it
+// to the client's worker. Returns -1 if the client is being
+// disconnected, 0 otherwise (inactive clients silently drop).
+int client_send_frame(client_t *c, frame_t *f);
+
+// Queue a reference to f under the overflow policy without writing.
+// Returns -1 if the client is being disconnected, 0 otherwise
+int client_queue_frame(client_t *c, frame_t *f);
+
+// The format c's publishes are sent in; set on every connect
+// (client_set_format), read by the publishing threads
+static inline pub_format_t client_format(const client_t *c)
+{
+	return __atomic_load_n(&c->format, __ATOMIC_RELAXED);
+}
+void client_set_format(client_t *c, pub_format_t fmt);
+
+// Send pub's frame in c's format, like client_send_frame(), to a
+// store-and-forward recipient: while the client is offline, keep a
+// reference to the frame for its reconnect instead, evicting the
+// oldest stored frames past the store limits. With a journal, each
+// format's frame is appended to it once for all offline recipients
+// of pub, by client_store_end() after the last recipient. Frames for
+// worker clients are pushed once the journal is unlocked again
+int client_send_or_store(client_t *c, publication_t *pub);
+void client_store_end(void);
+
+// Apply the journal's sync policy after a batch of publishes, or when
+// the time it returned (ms, -1: nothing waiting) is up
+long client_store_sync(void);
+
+// Journal recovery: a record kept for c was found at pos, or one
+// saying c had consumed everything up to pos
+void client_journal_visit(client_t *c, journal_pos_t pos, bool consumed);
+
+// Encode a one-off frame (e.g. an ACK) and client_send_frame() it
+int client_send(client_t *c, uint16_t type,
+				const void *payload, uint32_t len);
+
+// Write as much queued output as the socket takes, (dis)arming
+// EPOLLOUT as needed. Returns -1 on a fatal socket error.
+int client_flush(client_t *c);
+
+// Drop the queue and shut the socket down; the reactor then sees a
+// hangup and runs the usual disconnect path
+void client_kick(client_t *c);
+
+// Dump the client's queue and store counters to stderr
+void client_print_stats(const client_t *c);
+
+// Allocate an empty registry. Returns -1 on error
+int registry_init(client_registry_t *r);
+
+// Client registered under id, NULL if there is none
+client_t *registry_find(const client_registry_t *r, const char *id);
+
+// Grow the table so count clients fit without rehashing. Returns -1 on error
+int registry_reserve(client_registry_t *r, unsigned int count);
+
+// Register c under its ID (which must not be known yet). Returns -1 on error
+int registry_add(client_registry_t *r, client_t *c);
+
+// Client_destroy() every registered client and free the table
+void registry_destroy(client_registry_t *r, topic_node_t *root);
+
 // Read() from c->fd into its buffer, parse as many messages
-// (SUBSCRIBE/UNSUBSCRIBE), compact leftovers.
+// (SUBSCRIBE, with an optional " TYPE OP constant" value filter and an
+// optional trailing " 1" / " 0" store-and-forward flag, and
+// UNSUBSCRIBE), compact leftovers.
 // Returns -1 on disconnect/error, 0 otherwise.
 int client_handle_data(topic_node_t *root, client_t *c);
 
@@ -0,0 +1,36 @@
+#ifndef INTERN_H
+#define INTERN_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define INTERN_TABLE_INIT 256
+
+// one distinct topic segment, stored once for the whole trie; equal
+// segments are the same atom, so comparing them is a pointer compare
+typedef struct atom {
+	uint32_t hash;			// seg_hash(str, len)
+	uint32_t len;
+	unsigned int refs;		// trie links naming it
+	char str[];				// NUL-terminated
+} atom_t;
+
+// FNV-1a over a topic segment
+uint32_t seg_hash(const char *s, size_t len);
+
+// Return the atom for str[0..len), creating it if needed, and take a
+// reference. NULL on allocation failure.
+atom_t *atom_intern(const char *str, size_t len, uint32_t hash);
+
+// Find the atom without creating or referencing it; NULL means no trie
+// link was ever named str, so no exact child can match it
+atom_t *atom_lookup(const char *str, size_t len, uint32_t hash);
+
+// Drop a reference; the last one removes the atom from the table
+void atom_release(atom_t *a);
+
+// Table size and hit rates
+void atom_print_stats(FILE *out);
+
+#endif // INTERN_H
@@ -0,0 +1,129 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/uio.h>
+
+// bytes per segment file, mapped whole
+#define JOURNAL_SEGMENT_SIZE (64 << 20)
+// consumed segment files kept around for reuse
+#define JOURNAL_SPARES 2
+// recipients named by one record; more take several records
+#define JOURNAL_MAX_IDS 64
+// bytes of a client ID in a record, NUL padded
+#define JOURNAL_ID_LEN 16
+#define JOURNAL_SYNC_INTERVAL_MS 1000
+// bytes of records one journal_replay call looks at, at most
+#define JOURNAL_REPLAY_SCAN (1 << 20)
+
+// when appended records are forced to disk
+typedef enum {
+	JOURNAL_SYNC_NONE,		// left to the kernel's writeback
+	JOURNAL_SYNC_BATCH,		// msync at the end of every publish batch
+	JOURNAL_SYNC_INTERVAL	// ... at most once per interval
+} journal_sync_t;
+
+// a record's place in the log; seg 0 is no position
+typedef struct journal_pos {
+	uint32_t seg;
+	uint32_t off;
+} journal_pos_t;
+
+// one segment file, mapped MAP_SHARED for its whole size
+typedef struct journal_seg {
+	uint32_t seq;				// from the file name, consecutive
+	int fd;
+	char *map;
+	size_t size;				// file (and mapping) size
+	size_t used;				// bytes of records
+	unsigned int cursors;		// clients with their first record here
+} journal_seg_t;
+
+// Append-only log of publishes kept for offline clients. A record holds
+// the frame bytes once plus the IDs of the clients it is kept for; a
+// client only remembers the position of its first pending record and
+// replays from there with one sequential scan. Segments are recycled
+// once no cursor points at or before them.
+typedef struct journal {
+	pthread_mutex_t lock;		// appends, replays and cursor changes
+	char dir[256];
+	size_t seg_size;
+	journal_seg_t **segs;		// oldest first; the last one is appended to
+	unsigned int nsegs;
+	unsigned int seg_cap;
+	journal_seg_t *spares[JOURNAL_SPARES];
+	unsigned int nspares;
+	bool recovering;			// scanning on open: keep every segment
+
+	journal_sync_t sync;
+	unsigned int interval_ms;
+	size_t synced;				// tail bytes known to be on disk
+	long last_sync;				// ms, CLOCK_MONOTONIC
+
+	// counters, dumped by the "stats" command
+	unsigned long appended;
+	unsigned long appended_bytes;
+	unsigned long replayed;
+	unsigned long recycled;
+	unsigned long syncs;
+} journal_t;
+
+// Recovery: called for every client ID named by a record found on
+// open, in log order; consumed marks a record saying that the client
+// had everything up to it replayed
+typedef void (*journal_visit_fn)(void *arg, const char *id,
+								 journal_pos_t pos, bool consumed);
+
+// Called by journal_replay for each record kept for the client; a
+// non-zero return stops the replay before that record
+typedef int (*journal_replay_fn)(void *arg, const void *data, uint32_t len);
+
+// Open (creating if needed) the journal in dir and scan what is in it,
+// reporting recipients to visit (may be NULL). Returns -1 on error
+int journal_open(journal_t *j, const char *dir, size_t seg_size,
+				 journal_sync_t sync, unsigned int interval_ms,
+				 journal_visit_fn visit, void *arg);
+
+// Sync and unmap everything; the files stay for the next open
+void journal_close(journal_t *j);
+
+// Apply the sync policy to what was appended since the last call.
+// Returns the ms until the interval policy wants what is still not
+// on disk synced, -1 if nothing is waiting
+long journal_sync(journal_t *j);
+
+// Dump the counters
+void journal_print_stats(journal_t *j, FILE *out);
+
+void journal_lock(journal_t *j);
+void journal_unlock(journal_t *j);
+
+// The rest is called with the journal locked.
+
+// Append the bytes gathered from iov[0..niov), kept for the n clients
+// in ids. Returns the position of the (first) record, seg 0 on error
+journal_pos_t journal_append(journal_t *j,
+							 const struct iovec *iov, unsigned int niov,
+							 const char *const *ids, unsigned int n);
+
+// Feed fn the records from *pos on that name id, in order, until fn
+// stops or JOURNAL_REPLAY_SCAN bytes of records were looked at, so a
+// long backlog is replayed in several calls. *pos is left at the first
+// record not fed, seg 0 once the end of the log was reached. Returns
+// the number of records fed
+long journal_replay(journal_t *j, journal_pos_t *pos, const char *id,
+					journal_replay_fn fn, void *arg);
+
+// Record that id has consumed everything so far (for recovery)
+int journal_consumed(journal_t *j, const char *id);
+
+// A client's cursor starts / stops pointing at pos; segments no cursor
+// needs any more are recycled
+void journal_cursor_add(journal_t *j, journal_pos_t pos);
+void journal_cursor_drop(journal_t *j, journal_pos_t pos);
+
+#endif // JOURNAL_H
@@ -0,0 +1,65 @@
+#ifndef PAYLOAD_H
+#define PAYLOAD_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// value types: the byte after a datagram's topic field
+#define PAYLOAD_INT 0			// sign byte, uint32 (network order)
+#define PAYLOAD_SHORT_REAL 1	// uint16 hundredths (network order)
+#define PAYLOAD_FLOAT 2			// sign byte, uint32 mantissa, uint8 exponent
+#define PAYLOAD_STRING 3		// text, up to a NUL or the datagram's end
+
+// room payload_format() needs besides the payload's own length: the
+// type name, a sign and a FLOAT with 255 decimals behind "0."
+#define PAYLOAD_TEXT_ROOM 288
+
+// how a filter compares a publish's value with its constant
+typedef enum {
+	FILTER_LT,
+	FILTER_LE,
+	FILTER_GT,
+	FILTER_GE,
+	FILTER_EQ,
+	FILTER_NE
+} filter_op_t;
+
+// "TYPE OP constant" condition on a publish's value, e.g. "INT > 100":
+// only values of that (numeric) type can meet it
+typedef struct value_filter {
+	uint8_t type;			// PAYLOAD_INT, _SHORT_REAL or _FLOAT
+	uint8_t op;				// filter_op_t
+	double value;
+} value_filter_t;
+
+// a datagram's value as filters see it
+typedef struct payload_value {
+	int type;				// PAYLOAD_*, -1 if malformed
+	double num;				// numeric types only
+} payload_value_t;
+
+// Write v in decimal at out; returns the end (nothing is terminated)
+char *fmt_u32(char *out, uint32_t v);
+
+// Write m / 10^exp in decimal with exactly exp decimals (no point if
+// exp is 0), e.g. 42, 3 -> "0.042"; returns the end
+char *fmt_fixed(char *out, uint32_t m, unsigned int exp);
+
+// Render "TYPE - value\n" for a typed payload (type byte first) at out,
+// which has room for len + PAYLOAD_TEXT_ROOM bytes. Returns the length,
+// or -1 with *err set to why the payload is malformed
+int payload_format(char *out, const char *payload, size_t len,
+				   const char **err);
+
+// Decode a typed payload (type byte first) for filtering
+void payload_decode(const char *payload, size_t len, payload_value_t *v);
+
+// Parse "TYPE OP constant" (single spaces, e.g. "FLOAT <= -2.5") from
+// s[0..len) into f. Returns -1 if it is not a valid filter
+int filter_parse(const char *s, size_t len, value_filter_t *f);
+
+// Whether v meets f
+bool filter_match(const value_filter_t *f, const payload_value_t *v);
+
+#endif // PAYLOAD_H
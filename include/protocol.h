@@ -13,6 +13,7 @@
 #include <stdbool.h>
 #include <errno.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <sys/select.h>
 #include <netinet/in.h>
 
@@ -22,8 +23,24 @@
 #define MSG_PUBLISH     3
 #define MSG_SUBSCRIBE_ACK 4
 #define MSG_UNSUBSCRIBE_ACK 5
+#define MSG_PUBLISH_BIN 6
 
 #define MAX_TOPIC_LEN 50
+// largest UDP payload over IPv4: 65535 - 20 (IP) - 8 (UDP)
+#define MAX_UDP_PAYLOAD 65507
+// longest "a.b.c.d port " in front of a text publish
+#define PUB_TEXT_PREFIX_MAX (INET_ADDRSTRLEN + 1 + 5 + 1)
+// formatted text prefixes remembered per publishing thread, by source
+// address and port (direct-mapped, power of two)
+#define PREFIX_CACHE_SLOTS 2048
+// largest MSG_PUBLISH / MSG_PUBLISH_BIN payload
+#define MAX_PUBLISH_LEN (PUB_TEXT_PREFIX_MAX + MAX_UDP_PAYLOAD)
+// publish bodies up to this size are copied into their frames, bigger
+// ones are referenced in the buffer they were received into
+#define FRAME_COPY_MAX 2048
+// MSG_PUBLISH_BIN payload: IPv4 address and port (network order) and
+// topic length, then the topic and the datagram's type + value bytes
+#define PUB_BIN_HEADER 7
 
 // packed 2‑byte type + 4‑byte payload length
 #pragma pack(push,1)
@@ -33,6 +50,74 @@ typedef struct {
 } MsgHeader;
 #pragma pack(pop)
 
+// reference-counted byte buffer, e.g. a received datagram that frames
+// point into instead of copying it
+typedef struct rbuf {
+	unsigned int refs;
+	uint32_t size;
+	char data[];
+} rbuf_t;
+
+// immutable, reference-counted wire frame (header + payload), encoded
+// once per publish and shared by every recipient's outbound queue. The
+// first head_len bytes are in data[], the rest (if any) is body, which
+// lives in owner
+typedef struct frame {
+	unsigned int refs;
+	uint32_t len;		// sizeof(MsgHeader) + payload length
+	uint32_t head_len;
+	const char *body;
+	rbuf_t *owner;
+	char data[];
+} frame_t;
+
+// encode header + payload into a new frame holding one reference
+frame_t *frame_create(uint16_t type, const void *payload, uint32_t len);
+
+// take / drop a reference; the last release frees the frame
+frame_t *frame_ref(frame_t *f);
+void frame_release(frame_t *f);
+
+// the publish payload a subscriber asked for on its ID line
+typedef enum {
+	PUB_TEXT,		// MSG_PUBLISH: "a.b.c.d port " + the datagram as is
+	PUB_BINARY,		// MSG_PUBLISH_BIN, see PUB_BIN_HEADER
+	PUB_FORMATS
+} pub_format_t;
+
+// a datagram being delivered; its frames are encoded on first use,
+// at most once per format, and shared by every recipient
+typedef struct publication {
+	const struct sockaddr_in *src;
+	const char *data;		// MAX_TOPIC_LEN topic field, type, value
+	uint32_t len;
+	uint32_t tlen;			// topic length, at most MAX_TOPIC_LEN
+	rbuf_t *buf;			// holding data, to be referenced; NULL: copy it
+	frame_t *frames[PUB_FORMATS];
+} publication_t;
+
+// buffer of size bytes holding one reference, NULL if out of memory
+rbuf_t *rbuf_create(uint32_t size);
+// shrink an unshared buffer to size bytes; it may move
+rbuf_t *rbuf_shrink(rbuf_t *b, uint32_t size);
+rbuf_t *rbuf_ref(rbuf_t *b);
+void rbuf_release(rbuf_t *b);
+
+// new frame holding one reference, header filled in, payload left to
+// the caller (all of it in data[])
+frame_t *frame_alloc(uint16_t type, uint32_t len);
+
+// Fill iov (2 entries at most) with f's bytes from off on; returns how
+// many entries were used
+int frame_iov(const frame_t *f, uint32_t off, struct iovec *iov);
+
+// The frame of p in format fmt (encoded now if needed, owned by p);
+// NULL if out of memory
+frame_t *publication_frame(publication_t *p, pub_format_t fmt);
+
+// drop p's references to its frames
+void publication_release(publication_t *p);
+
 // send() until everything’s written
 int send_all(int fd, const void *buf, size_t len);
 
@@ -0,0 +1,48 @@
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <stddef.h>
+#include <stdio.h>
+
+// objects carved per slab when a pool runs dry
+#define SLAB_OBJS 256
+
+// typed pool of fixed-size objects: whole slabs are taken from malloc,
+// freed objects go on a free list and are never handed back to libc
+typedef struct slab_pool {
+	const char *name;
+	size_t obj_size;			// rounded up to pointer alignment
+	void *free_list;			// next free object, linked through word 0
+	struct slab *slabs;
+	unsigned long in_use;		// objects handed out
+	unsigned long capacity;		// objects carved so far
+	unsigned long nslabs;
+} slab_pool_t;
+
+#define SLAB_POOL_INIT(pname, size) { .name = (pname), .obj_size = (size) }
+
+// Take an object from the pool (uninitialised); NULL if out of memory
+void *slab_alloc(slab_pool_t *p);
+
+// Take a zeroed object
+void *slab_zalloc(slab_pool_t *p);
+
+// Give obj back to its pool
+void slab_free(slab_pool_t *p, void *obj);
+
+// One-line occupancy report
+void slab_print_stats(const slab_pool_t *p, FILE *out);
+
+// — size-class arena —
+// variable-size blocks in power-of-two slab classes (16..128 bytes),
+// bigger ones fall back to malloc; the caller passes the size back on
+// free
+
+void *arena_alloc(size_t size);
+void arena_free(void *p, size_t size);
+void arena_print_stats(FILE *out);
+
+// slabs taken from malloc by every pool so far (incl. the arena)
+unsigned long slab_heap_allocs(void);
+
+#endif // SLAB_H
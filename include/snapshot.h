@@ -0,0 +1,41 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdbool.h>
+#include <sys/types.h>
+
+#include "client_server.h"
+#include "topic_trie.h"
+
+// seconds between periodic snapshots, when a snapshot file is given
+#define DEFAULT_SNAPSHOT_INTERVAL 60
+
+// Registers (or finds) the client named id; NULL on error
+typedef client_t *(*snapshot_client_fn)(client_registry_t *reg,
+										const char *id);
+
+// Write every registered client and the whole trie with its
+// subscribers to path (through a temporary file renamed over it).
+// Only call from the thread making subscription changes. Returns -1
+// on error, leaving the previous snapshot in place
+int snapshot_save(const char *path, topic_node_t *root,
+				  const client_registry_t *reg);
+
+// snapshot_save() from a forked child, so the caller goes on while the
+// file is written and synced. Same caller rule; the trie is saved as
+// it is at the call. Returns the child's pid, -1 if fork failed
+pid_t snapshot_save_bg(const char *path, topic_node_t *root,
+					   const client_registry_t *reg);
+
+// Reap the child of snapshot_save_bg, waiting for it if block. Returns
+// 0 if it is still running, 1 if it saved the snapshot, -1 if it failed
+int snapshot_wait(pid_t pid, bool block);
+
+// Rebuild the clients (inactive, through get) and the trie saved in
+// path into reg and an empty root. Returns 1 if loaded, 0 if there is
+// no snapshot, -1 if it is unreadable or corrupt (nothing loaded) or
+// memory ran out while loading
+int snapshot_load(const char *path, topic_node_t *root,
+				  client_registry_t *reg, snapshot_client_fn get);
+
+#endif // SNAPSHOT_H
@@ -3,12 +3,17 @@
 
 #include "client_server.h"
 #include "protocol.h"
+#include "intern.h"
+#include "payload.h"
 
 typedef struct client client_t;
 
 // linked list of subscribers on each node
 typedef struct client_list {
 	client_t *cl;
+	bool sf;				// store-and-forward while cl is offline
+	bool filtered;			// only publishes meeting filter are sent
+	value_filter_t filter;
 	struct client_list *next;
 } client_list_t;
 
@@ -19,13 +24,40 @@ typedef enum {
 	CHILD_STAR		// '*' wildcard child
 } child_type_t;
 
+// named children stay in the node's inline array up to this many,
+// past that they move to an open-addressing hash table
+#define CHILD_INLINE 4
+#define CHILD_TABLE_INIT 16
+
+// deepest topic or pattern accepted, in '/'-separated levels
+#define MAX_TOPIC_LEVELS 64
+
+// publish match cache: byte budget and hash buckets
+#define DEFAULT_MATCH_CACHE_BYTES (4 << 20)
+#define MATCH_CACHE_BUCKETS 4096
+
+// matching threads (the reactor plus ingest threads), each with its
+// own match context; dedupe/memo sets start at this many slots
+#define MAX_MATCH_CTX 33
+#define STAMP_SET_INIT 256
+
+// per-thread match state: dedupe and memo sets, recipient vector,
+// match cache and the lock a publish holds (opaque)
+typedef struct match_ctx match_ctx_t;
+
+// exact-match child link, holding the reference to its name's atom
+struct child {
+	atom_t *atom;
+	uint32_t hash;			// atom->hash, kept inline for probing
+	struct topic_node *node;	// NULL marks a free table slot
+};
+
 // trie node
 typedef struct topic_node {
-	struct child {
-		char *name;
-		struct topic_node *node;
-		struct child *next;
-	} *children;
+	unsigned int nchildren;
+	unsigned int child_cap;		// table slots (power of two), 0 if inline
+	struct child small[CHILD_INLINE];
+	struct child *table;
 
 	struct topic_node *plus_child;
 	struct topic_node *star_child;
@@ -35,9 +67,35 @@ typedef struct topic_node {
 	// for pruning
 	struct topic_node *parent;
 	child_type_t ptype;
-	char *pname;
+	atom_t *pname;			// borrowed from the parent's child link
 } topic_node_t;
 
+// one '/'-separated segment, as a view into the caller's bytes
+typedef struct seg_span {
+	uint32_t off;
+	uint32_t len;
+	uint32_t hash;			// seg_hash of the segment
+} seg_span_t;
+
+// a matched client; sf if any subscription it matched through asked
+// for store-and-forward. filter (in the subscriber entry) is NULL once
+// an unconditional subscription matched. A client matched through
+// several conditional ones gets a row per condition, all multi: it is
+// sent the publish once, through the first row whose condition holds
+typedef struct recipient {
+	client_t *cl;
+	const value_filter_t *filter;
+	bool sf;
+	bool multi;
+} recipient_t;
+
+// growable array of recipients
+typedef struct client_vec {
+	recipient_t *v;
+	size_t n;
+	size_t cap;
+} client_vec_t;
+
 // to let a client quickly unsubscribe/disconnect
 typedef struct sub_ref {
 	topic_node_t *node;
@@ -46,10 +104,50 @@ typedef struct sub_ref {
 
 topic_node_t *node_create(topic_node_t *parent,
 						  child_type_t ptype,
-						  const char *pname);
-int trie_subscribe(topic_node_t *root, client_t *cl, const char *pattern);
-int trie_unsubscribe(topic_node_t *root, client_t *cl, const char *pattern);
-void trie_publish(topic_node_t *root, const char *topic, const char *buf, size_t len);
+						  atom_t *pname);
+// Find or create parent's child of kind ptype (named by span sp of
+// str for CHILD_NAME). NULL on allocation failure
+topic_node_t *node_child(topic_node_t *parent, child_type_t ptype,
+						 const char *str, const seg_span_t *sp);
+// Make room for count named children of n without rehashing
+int node_reserve_children(topic_node_t *n, unsigned int count);
+// Add cl to n's subscribers (and n to cl's subscriptions), with an
+// optional filter (copied). Trie writers only
+int node_add_subscriber(topic_node_t *n, client_t *cl, bool sf,
+						const value_filter_t *filter);
+// Split topic[0..len) into spans without copying it; empty segments
+// are skipped. Returns the segment count, -1 if there are more than max
+int topic_tokenize(const char *topic, size_t len, seg_span_t *spans, int max);
+
+// Subscription changes take the trie for writing (every match
+// context's lock); publishes lock only their own context. A filter
+// (NULL: none) limits the subscription to publishes whose value meets
+// it. The ack frame (NULL: none) is client_send_frame()d to cl before
+// the lock is dropped, so it is ordered with cl's publishes. Returns -1
+// on error or if cl is being disconnected
+int trie_subscribe(topic_node_t *root, client_t *cl, const char *pattern,
+				   bool sf, const value_filter_t *filter, frame_t *ack);
+int trie_unsubscribe(topic_node_t *root, client_t *cl, const char *pattern,
+					 frame_t *ack);
+int match_topic(topic_node_t *root, const char *topic, size_t tlen,
+				client_vec_t *out);
+// Deliver pub to every matching subscriber, in its format; pub keeps
+// the frames it encoded (publication_release them)
+void trie_publish(topic_node_t *root, publication_t *pub);
 void cleanup_client_subscriptions(topic_node_t *root, client_t *cl);
 
+// A context for one more matching thread; only call before that
+// thread (and any other new one) starts publishing. NULL if all
+// MAX_MATCH_CTX are taken. The reactor thread starts with its own
+match_ctx_t *match_ctx_create(void);
+// Make ctx the calling thread's match context
+void match_ctx_enter(match_ctx_t *ctx);
+
+// match cache byte budget per context (0 disables it), counters dump
+void trie_cache_configure(size_t budget);
+void trie_print_stats(void);
+
+// heap allocations made by the trie so far
+unsigned long trie_alloc_count(void);
+
 #endif // TOPIC_TRIE_H
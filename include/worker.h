@@ -0,0 +1,73 @@
+#ifndef WORKER_H
+#define WORKER_H
+
+#include <pthread.h>
+
+#include "client_server.h"
+
+// delivery threads the server may be started with
+#define MAX_WORKERS 64
+// slots in each worker's inbound queue (power of two)
+#define WORK_QUEUE_SIZE (1 << 16)
+// items a worker applies before flushing the sockets they touched
+#define WORK_BATCH 1024
+
+// what a queued item asks the worker to do with its client
+typedef enum {
+	WORK_FRAME,		// queue f on the client's socket
+	WORK_ATTACH,	// fd is the client's new socket
+	WORK_REPLAY,	// send the client's journal backlog (client_replay)
+	WORK_DETACH,	// drop pending output, close the socket
+	WORK_STOP		// exit the thread (no client)
+} work_op_t;
+
+typedef struct work_item {
+	uint64_t seq;			// ring turn, see worker_push
+	work_op_t op;
+	int fd;
+	client_t *c;
+	frame_t *f;
+} work_item_t;
+
+// A delivery thread owning the output side of a shard of clients:
+// their outbound queues, EPOLLOUT and every write to their sockets.
+// It is fed through a bounded multi-producer / single-consumer ring
+// (per-slot sequence numbers, no locks, no allocation per item), so
+// everything queued for one client by one producer is applied in order.
+typedef struct worker {
+	pthread_t tid;
+	unsigned int index;
+	int epfd;					// watches the shard's sockets for EPOLLOUT
+	int evfd;					// eventfd rung when the worker sleeps
+	work_item_t *q;
+
+	uint64_t tail __attribute__((aligned(64)));	// next slot, producers
+	uint64_t head __attribute__((aligned(64)));	// next slot, the worker
+	int sleeping;				// parked in epoll_wait, needs a ring
+
+	client_t *dirty;			// clients queued to since the last flush
+
+	// counters, dumped by the "stats" command
+	unsigned long items;
+	unsigned long wakeups;
+	unsigned long full_waits;	// producer found the ring full
+	unsigned int clients;		// shard size
+} worker_t;
+
+// Start k delivery threads. Returns -1 on error
+int workers_start(unsigned int k);
+
+// Queue a stop behind everything already pushed and join the threads
+void workers_stop(void);
+
+// Shard for a new client (round-robin), NULL when no workers run
+worker_t *worker_pick(void);
+
+// Hand the worker an item for c, taking a reference to f if given.
+// Waits (yielding) while the ring is full
+void worker_push(worker_t *w, work_op_t op, client_t *c, int fd, frame_t *f);
+
+// Dump every worker's counters to stderr
+void workers_print_stats(void);
+
+#endif // WORKER_H
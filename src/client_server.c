@@ -1,34 +1,775 @@
 // 324CC Stefan CALMAC
 #include "../include/client_server.h"
+#include "../include/worker.h"
 
-// Create + disable Nagle
-client_t *client_create(int fd, const char *id)
+#include <fcntl.h>
+#include <sys/epoll.h>
+
+// iovecs handed to one sendmsg() by client_flush (up to 2 per frame)
+#define FLUSH_IOV 64
+// initial outbound ring size, doubled on demand
+#define OUT_RING_INIT 16
+// worker frames held back while the journal is locked, see deferred
+#define DEFER_MAX 256
+
+static size_t out_hwm = DEFAULT_OUT_HWM;
+static out_policy_t out_policy = OUT_DROP_OLDEST;
+static unsigned int store_max_msgs = DEFAULT_STORE_MSGS;
+static size_t store_max_bytes = DEFAULT_STORE_BYTES;
+static journal_t *journal;
+
+// offline recipients of the publish being stored, by format, see
+// client_store_end; the journal is locked from the first one on
+static __thread client_t *pending[PUB_FORMATS][JOURNAL_MAX_IDS];
+static __thread unsigned int npending[PUB_FORMATS];
+static __thread frame_t *pending_frame[PUB_FORMATS];
+static __thread bool journal_held;
+
+// frames for worker clients sent while this thread holds the journal,
+// pushed once it is released: the worker may be waiting for the
+// journal in client_replay instead of draining its ring
+typedef struct deferred {
+	client_t *c;
+	frame_t *f;					// referenced
+} deferred_t;
+static __thread deferred_t deferred[DEFER_MAX];
+static __thread unsigned int ndeferred;
+
+void client_set_out_limits(size_t hwm, out_policy_t policy)
+{
+	out_hwm = hwm;
+	out_policy = policy;
+}
+
+void client_set_store_limits(unsigned int msgs, size_t bytes)
+{
+	store_max_msgs = msgs;
+	store_max_bytes = bytes;
+}
+
+void client_set_journal(journal_t *j)
+{
+	journal = j;
+}
+
+client_t *client_create(const char *id)
 {
-	client_t *c = malloc(sizeof(*c));
+	client_t *c = calloc(1, sizeof(*c));
 	if (!c)
 		return NULL;
 
-	c->fd = fd;
+	c->fd = -1;
+	c->epfd = -1;
+	c->out_fd = -1;
+	c->out_epfd = -1;
 	strncpy(c->id, id, sizeof(c->id) - 1);
 	c->id[sizeof(c->id) - 1] = '\0';
-	c->read_buf_len = 0;
-	c->next = NULL;
+	c->id_hash = seg_hash(c->id, strlen(c->id));
+	pthread_mutex_init(&c->store_lock, NULL);
 
-	int flag = 1;
+	return c;
+}
+
+// — store-and-forward ring, under store_lock —
+
+// release the oldest stored frame
+static void store_pop(client_t *c)
+{
+	frame_t *f = c->store_q[c->store_first];
+	c->store_bytes -= f->len;
+	frame_release(f);
+	c->store_first = (c->store_first + 1) & (c->store_cap - 1);
+	c->store_count--;
+}
 
+// keep a reference to f, evicting the oldest frames past the limits
+static void store_push(client_t *c, frame_t *f)
+{
+	if (f->len > store_max_bytes || !store_max_msgs) {
+		c->msgs_evicted++;
+		return;
+	}
+	while (c->store_count &&
+		   (c->store_count >= store_max_msgs ||
+			c->store_bytes + f->len > store_max_bytes)) {
+		store_pop(c);
+		c->msgs_evicted++;
+	}
+
+	if (c->store_count == c->store_cap) {
+		unsigned int cap = c->store_cap ? c->store_cap * 2 : OUT_RING_INIT;
+		frame_t **q = malloc(cap * sizeof(*q));
+		if (!q) {
+			c->msgs_evicted++;
+			return;
+		}
+		for (unsigned int i = 0; i < c->store_count; i++)
+			q[i] = c->store_q[(c->store_first + i) & (c->store_cap - 1)];
+		free(c->store_q);
+		c->store_q = q;
+		c->store_cap = cap;
+		c->store_first = 0;
+	}
+
+	unsigned int i = (c->store_first + c->store_count) & (c->store_cap - 1);
+	c->store_q[i] = frame_ref(f);
+	c->store_bytes += f->len;
+	c->store_count++;
+	c->msgs_stored++;
+}
+
+// append f once for every offline recipient pending in its format; a
+// client's cursor is its first record (journal locked)
+static void journal_store(pub_format_t fmt, frame_t *f)
+{
+	const char *ids[JOURNAL_MAX_IDS];
+	for (unsigned int i = 0; i < npending[fmt]; i++)
+		ids[i] = pending[fmt][i]->id;
+	struct iovec iov[2];
+	int niov = frame_iov(f, 0, iov);
+	journal_pos_t pos = journal_append(journal, iov, niov,
+									   ids, npending[fmt]);
+
+	for (unsigned int i = 0; i < npending[fmt]; i++) {
+		client_t *c = pending[fmt][i];
+		if (!pos.seg) {
+			c->msgs_evicted++;
+			continue;
+		}
+		c->msgs_stored++;
+		if (!c->jcursor.seg) {
+			c->jcursor = pos;
+			journal_cursor_add(journal, pos);
+		}
+	}
+	npending[fmt] = 0;
+}
+
+// write the pending records, unlock the journal and push what was
+// held back meanwhile
+static void journal_release(void)
+{
+	for (int fmt = 0; fmt < PUB_FORMATS; fmt++)
+		if (npending[fmt])
+			journal_store(fmt, pending_frame[fmt]);
+	journal_held = false;
+	journal_unlock(journal);
+
+	for (unsigned int i = 0; i < ndeferred; i++) {
+		client_t *c = deferred[i].c;
+		worker_push(c->worker, WORK_FRAME, c, -1, deferred[i].f);
+		frame_release(deferred[i].f);
+	}
+	ndeferred = 0;
+}
+
+// hand every stored frame to the freshly attached socket, in order
+static void store_replay(client_t *c)
+{
+	while (c->store_count) {
+		frame_t *f = frame_ref(c->store_q[c->store_first]);
+		store_pop(c);
+		c->msgs_replayed++;
+		int ret = client_send_frame(c, f);
+		frame_release(f);
+		if (ret < 0) {
+			// kicked (queue limit): the rest is lost with the socket
+			while (c->store_count)
+				store_pop(c);
+			break;
+		}
+	}
+}
+
+// Non-blocking + disable Nagle + register with the reactor
+int client_attach(client_t *c, int fd, int epfd)
+{
+	int flags = fcntl(fd, F_GETFL, 0);
+	if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0)
+		return -1;
+
+	int flag = 1;
 	if (setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag)) < 0)
-		return NULL;
+		return -1;
 
-	return c;
+	struct epoll_event ev = {.events = EPOLLIN, .data.ptr = c};
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0)
+		return -1;
+
+	// the output side first, with no lock held: the worker may be
+	// waiting for the journal in client_replay while its ring is full
+	if (c->worker)
+		worker_push(c->worker, WORK_ATTACH, c, fd, NULL);
+	else
+		client_out_attach(c, fd, epfd);
+
+	// journal before store lock, as in a publish
+	if (journal)
+		journal_lock(journal);
+	pthread_mutex_lock(&c->store_lock);
+	// fd is peeked at by ingest threads, see client_send_frame: one
+	// that sees it pushes its frames behind the WORK_ATTACH above
+	__atomic_store_n(&c->fd, fd, __ATOMIC_RELEASE);
+	c->epfd = epfd;
+	c->state = CLIENT_ACTIVE;
+	c->read_buf_len = 0;
+	// still under the lock: later publishes queue behind the replay.
+	// Only the RAM store has frames here, and then no worker ever
+	// waits for the lock
+	store_replay(c);
+	pthread_mutex_unlock(&c->store_lock);
+	if (journal)
+		journal_unlock(journal);
+
+	// the journal's backlog, now that c is active: until it is all
+	// queued, publishes journal c's frames behind it (jcursor)
+	if (!c->worker)
+		client_replay(c);
+	else if (journal)
+		worker_push(c->worker, WORK_REPLAY, c, -1, NULL);
+	return 0;
+}
+
+void client_out_attach(client_t *c, int fd, int out_epfd)
+{
+	c->out_fd = fd;
+	c->out_epfd = out_epfd;
+	c->want_out = false;
+	c->closing = false;
+	c->replaying = false;
+}
+
+// ring slot i positions after the oldest one
+static inline out_slot_t *out_slot(client_t *c, unsigned int i)
+{
+	return &c->out_q[(c->out_first + i) & (c->out_cap - 1)];
+}
+
+// append a frame reference, growing the ring when full
+int out_queue_push(client_t *c, frame_t *f)
+{
+	if (c->out_count == c->out_cap) {
+		unsigned int cap = c->out_cap ? c->out_cap * 2 : OUT_RING_INIT;
+		out_slot_t *q = malloc(cap * sizeof(*q));
+		if (!q)
+			return -1;
+		// unwrap the old ring into the front of the new one
+		for (unsigned int i = 0; i < c->out_count; i++)
+			q[i] = *out_slot(c, i);
+		free(c->out_q);
+		c->out_q = q;
+		c->out_cap = cap;
+		c->out_first = 0;
+	}
+
+	out_slot_t *s = out_slot(c, c->out_count);
+	s->frame = frame_ref(f);
+	s->off = 0;
+	c->out_count++;
+	return 0;
+}
+
+// release the oldest slot
+void out_queue_pop(client_t *c)
+{
+	frame_release(c->out_q[c->out_first].frame);
+	c->out_first = (c->out_first + 1) & (c->out_cap - 1);
+	c->out_count--;
+}
+
+// release every queued frame, counting what never made it out
+void out_queue_clear(client_t *c)
+{
+	while (c->out_count) {
+		out_slot_t *s = out_slot(c, 0);
+		c->bytes_dropped += s->frame->len - s->off;
+		c->msgs_dropped++;
+		out_queue_pop(c);
+	}
+	c->out_bytes = 0;
+}
+
+void client_detach(client_t *c)
+{
+	if (c->fd < 0)
+		return;
+	int fd = c->fd;
+	epoll_ctl(c->epfd, EPOLL_CTL_DEL, fd, NULL);
+	pthread_mutex_lock(&c->store_lock);
+	__atomic_store_n(&c->fd, -1, __ATOMIC_RELAXED);
+	c->state = CLIENT_INACTIVE;
+	pthread_mutex_unlock(&c->store_lock);
+	// pushed without the lock, as in client_attach; frames pushed
+	// before it still go out first
+	if (c->worker)
+		worker_push(c->worker, WORK_DETACH, c, fd, NULL);
+	else
+		client_out_close(c);
+}
+
+void client_out_close(client_t *c)
+{
+	if (c->out_fd < 0)
+		return;
+	if (c->out_epfd != c->epfd)
+		epoll_ctl(c->out_epfd, EPOLL_CTL_DEL, c->out_fd, NULL);
+	close(c->out_fd);
+	c->out_fd = -1;
+	out_queue_clear(c);
 }
 
 void client_destroy(topic_node_t *root, client_t *c)
 {
 	cleanup_client_subscriptions(root, c);
-	close(c->fd);
+	client_detach(c);
+	while (c->store_count)
+		store_pop(c);
+	free(c->store_q);
+	pthread_mutex_destroy(&c->store_lock);
+	free(c->out_q);
 	free(c);
 }
 
+// arm EPOLLOUT only while there is something left to write
+int client_want_out(client_t *c, bool want)
+{
+	if (c->want_out == want)
+		return 0;
+
+	// a worker only watches for output, one wakeup per arming
+	uint32_t base = c->worker ? EPOLLONESHOT : EPOLLIN;
+	struct epoll_event ev = {
+		.events = base | (want ? EPOLLOUT : 0),
+		.data.ptr = c};
+	if (epoll_ctl(c->out_epfd, EPOLL_CTL_MOD, c->out_fd, &ev) < 0)
+		return -1;
+	c->want_out = want;
+	return 0;
+}
+
+void client_kick(client_t *c)
+{
+	c->closing = true;
+	out_queue_clear(c);
+	shutdown(c->out_fd, SHUT_RDWR);
+}
+
+// make room for `len` more bytes according to the overflow policy;
+// returns 0 if the new frame may be queued
+int out_queue_make_room(client_t *c, size_t len)
+{
+	if (c->out_bytes + len <= out_hwm)
+		return 0;
+
+	// a worker batches writes: the socket may well take the backlog
+	if (c->out_count && !c->want_out) {
+		if (client_flush(c) < 0) {
+			client_kick(c);
+			return -1;
+		}
+		if (c->out_bytes + len <= out_hwm)
+			return 0;
+	}
+
+	// a journal replay fills the queue on purpose: what does not fit
+	// behind it is dropped, never the replayed frames or the client
+	switch (c->replaying ? OUT_DROP_NEWEST : out_policy) {
+	case OUT_DROP_OLDEST: {
+		// the head may be half written: evicting it would corrupt framing,
+		// so it is kept and the next oldest slot goes instead
+		unsigned int keep = (c->out_count && out_slot(c, 0)->off > 0);
+		while (c->out_count > keep && c->out_bytes + len > out_hwm) {
+			out_slot_t *victim = out_slot(c, keep);
+			c->out_bytes -= victim->frame->len;
+			c->bytes_dropped += victim->frame->len;
+			c->msgs_dropped++;
+			if (keep) {
+				// slide the partial head forward over the victim
+				frame_release(victim->frame);
+				*victim = *out_slot(c, 0);
+				c->out_first = (c->out_first + 1) & (c->out_cap - 1);
+				c->out_count--;
+			} else {
+				out_queue_pop(c);
+			}
+		}
+		if (c->out_bytes + len <= out_hwm)
+			return 0;
+		break;
+	}
+	case OUT_DROP_NEWEST:
+		break;
+	case OUT_DISCONNECT:
+		fprintf(stderr, "Client %s over its queue limit, disconnecting\n",
+				c->id);
+		client_kick(c);
+		return -1;
+	}
+
+	c->bytes_dropped += len;
+	c->msgs_dropped++;
+	return -1;
+}
+
+int client_queue_frame(client_t *c, frame_t *f)
+{
+	if (c->closing)
+		return -1;
+	if (c->out_fd < 0)
+		return 0;
+
+	if (out_queue_make_room(c, f->len) < 0)
+		return c->closing ? -1 : 0;
+	if (out_queue_push(c, f) < 0) {
+		c->bytes_dropped += f->len;
+		c->msgs_dropped++;
+		return 0;
+	}
+	c->out_bytes += f->len;
+	c->bytes_queued += f->len;
+	return 0;
+}
+
+int client_send_frame(client_t *c, frame_t *f)
+{
+	// the worker queues and writes it, batched with its other frames
+	if (c->worker) {
+		// a stale answer is harmless: the worker checks its own fd.
+		// Pairs with client_attach, so no frame overtakes the attach
+		if (__atomic_load_n(&c->fd, __ATOMIC_ACQUIRE) < 0)
+			return 0;
+		if (journal_held && ndeferred == DEFER_MAX)
+			journal_release();
+		if (journal_held) {
+			deferred[ndeferred].c = c;
+			deferred[ndeferred++].f = frame_ref(f);
+		} else {
+			worker_push(c->worker, WORK_FRAME, c, -1, f);
+		}
+		return 0;
+	}
+
+	if (client_queue_frame(c, f) < 0)
+		return -1;
+	if (c->out_fd < 0)
+		return 0;
+
+	// if EPOLLOUT is armed the socket is full anyway, wait for it
+	if (!c->want_out && client_flush(c) < 0) {
+		client_kick(c);
+		return -1;
+	}
+	return 0;
+}
+
+void client_set_format(client_t *c, pub_format_t fmt)
+{
+	__atomic_store_n(&c->format, fmt, __ATOMIC_RELAXED);
+}
+
+int client_send_or_store(client_t *c, publication_t *pub)
+{
+	frame_t *live = NULL;
+	pthread_mutex_lock(&c->store_lock);
+	// a client still replaying its journal gets new frames through it
+	// too, behind the older ones (its cursor only moves under both locks)
+	if (journal && !journal_held &&
+		(c->state != CLIENT_ACTIVE || c->jcursor.seg)) {
+		// first offline recipient: journal before store lock, as in
+		// client_attach, then look at the state again
+		pthread_mutex_unlock(&c->store_lock);
+		journal_lock(journal);
+		journal_held = true;
+		pthread_mutex_lock(&c->store_lock);
+	}
+	// stored frames keep the format they were stored in; their message
+	// type tells a subscriber which one it is
+	pub_format_t fmt = client_format(c);
+	frame_t *f = publication_frame(pub, fmt);
+	if (!f) {
+		c->msgs_evicted += c->state != CLIENT_ACTIVE;
+	} else if (c->state == CLIENT_ACTIVE && !c->jcursor.seg) {
+		live = f;
+	} else if (journal) {
+		// the journal lock, held until client_store_end, keeps c from
+		// reconnecting, or finishing its replay, before the record is
+		// written
+		pending[fmt][npending[fmt]++] = c;
+		pending_frame[fmt] = f;
+		if (npending[fmt] == JOURNAL_MAX_IDS)
+			journal_store(fmt, f);
+	} else {
+		store_push(c, f);
+	}
+	pthread_mutex_unlock(&c->store_lock);
+
+	// sent without the store lock, which c's worker may be waiting for
+	// in client_replay
+	return live ? client_send_frame(c, live) : 0;
+}
+
+void client_store_end(void)
+{
+	if (journal_held)
+		journal_release();
+}
+
+long client_store_sync(void)
+{
+	return journal ? journal_sync(journal) : -1;
+}
+
+void client_journal_visit(client_t *c, journal_pos_t pos, bool consumed)
+{
+	if (consumed) {
+		if (c->jcursor.seg)
+			journal_cursor_drop(journal, c->jcursor);
+		c->jcursor = (journal_pos_t){0, 0};
+	} else if (!c->jcursor.seg) {
+		c->jcursor = pos;
+		journal_cursor_add(journal, pos);
+	}
+}
+
+// journal_replay_fn: queue one journaled frame while the outbound queue
+// is under its limit (an empty one takes any frame). The limit's policy
+// is not applied: the rest of the backlog just waits for the queue to
+// drain, see client_replay
+static int journal_replay_frame(void *arg, const void *data, uint32_t len)
+{
+	client_t *c = arg;
+	if (c->out_bytes && c->out_bytes + len > out_hwm)
+		return 1;
+
+	uint16_t type;
+	memcpy(&type, data, sizeof(type));
+	const char *payload = (const char *)data + sizeof(MsgHeader);
+	frame_t *f = frame_create(ntohs(type), payload, len - sizeof(MsgHeader));
+	if (!f || out_queue_push(c, f) < 0) {
+		c->bytes_dropped += len;
+		c->msgs_dropped++;
+	} else {
+		c->out_bytes += f->len;
+		c->bytes_queued += f->len;
+		c->msgs_replayed++;
+	}
+	frame_release(f);
+	return 0;
+}
+
+// queue what fits of c's journal backlog, moving its cursor past it
+// (journal and store locked); true once nothing is left to replay here
+static bool journal_replay_step(client_t *c)
+{
+	// detached meanwhile: the rest waits for the next connect
+	if (!c->jcursor.seg || c->state != CLIENT_ACTIVE)
+		return true;
+
+	journal_pos_t pos = c->jcursor;
+	journal_replay(journal, &pos, c->id, journal_replay_frame, c);
+	if (pos.seg) {
+		if (pos.seg != c->jcursor.seg) {
+			journal_cursor_add(journal, pos);
+			journal_cursor_drop(journal, c->jcursor);
+		}
+		c->jcursor = pos;
+		return false;
+	}
+
+	// all of it is queued: a restart must not replay it again
+	if (journal_consumed(journal, c->id) < 0)
+		fprintf(stderr, "journal: could not record %s's replay\n", c->id);
+	journal_cursor_drop(journal, c->jcursor);
+	c->jcursor = (journal_pos_t){0, 0};
+	return true;
+}
+
+void client_replay(client_t *c)
+{
+	if (!journal)
+		return;
+	bool done = false;
+	while (!done && c->out_fd >= 0 && !c->closing) {
+		journal_lock(journal);
+		pthread_mutex_lock(&c->store_lock);
+		done = journal_replay_step(c);
+		pthread_mutex_unlock(&c->store_lock);
+		journal_unlock(journal);
+		c->replaying = !done;
+
+		if (client_flush(c) < 0) {
+			client_kick(c);
+			return;
+		}
+		// the socket is full: EPOLLOUT resumes the replay
+		if (c->want_out)
+			return;
+	}
+}
+
+int client_send(client_t *c, uint16_t type,
+				const void *payload, uint32_t len)
+{
+	frame_t *f = frame_create(type, payload, len);
+	if (!f)
+		return c->closing ? -1 : 0;
+	int ret = client_send_frame(c, f);
+	frame_release(f);
+	return ret;
+}
+
+int client_flush(client_t *c)
+{
+	while (c->out_count) {
+		struct iovec iov[FLUSH_IOV];
+		unsigned int cnt = 0;
+		for (unsigned int i = 0;
+			 i < c->out_count && cnt + 2 <= FLUSH_IOV; i++) {
+			out_slot_t *s = out_slot(c, i);
+			cnt += frame_iov(s->frame, s->off, iov + cnt);
+		}
+
+		struct msghdr mh = {.msg_iov = iov, .msg_iovlen = cnt};
+		ssize_t w = sendmsg(c->out_fd, &mh, MSG_NOSIGNAL);
+		if (w < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			return -1;
+		}
+
+		// retire fully written frames, remember how far we got in the last
+		c->out_bytes -= w;
+		while (w > 0) {
+			out_slot_t *s = out_slot(c, 0);
+			size_t left = s->frame->len - s->off;
+			if ((size_t)w < left) {
+				s->off += w;
+				break;
+			}
+			w -= left;
+			out_queue_pop(c);
+		}
+	}
+
+	return client_want_out(c, c->out_count != 0);
+}
+
+void client_print_stats(const client_t *c)
+{
+	fprintf(stderr,
+			"client %s: %s, queued %lu B, pending %zu B, dropped %lu B (%lu msgs), "
+			"stored %lu msgs (%u held, %zu B), evicted %lu, replayed %lu\n",
+			c->id, c->state == CLIENT_ACTIVE ? "active" : "inactive",
+			c->bytes_queued, c->out_bytes,
+			c->bytes_dropped, c->msgs_dropped,
+			c->msgs_stored, c->store_count, c->store_bytes,
+			c->msgs_evicted, c->msgs_replayed);
+}
+
+// strip a trailing " 1" / " 0" store-and-forward flag off a subscribe
+// payload, returning it (false when absent)
+bool parse_sf_flag(char *payload, uint32_t *len)
+{
+	if (*len < 2 || payload[*len - 2] != ' ' ||
+		(payload[*len - 1] != '0' && payload[*len - 1] != '1'))
+		return false;
+	bool sf = payload[*len - 1] == '1';
+	*len -= 2;
+	payload[*len] = '\0';
+	return sf;
+}
+
+// strip a trailing " TYPE OP constant" filter (e.g. " INT > 100") off
+// a subscribe payload into f; false (payload untouched) when there is
+// none, so patterns keep meaning what they did without one
+bool parse_value_filter(char *payload, uint32_t *len, value_filter_t *f)
+{
+	// the third space from the end starts the filter
+	uint32_t i = *len;
+	for (int spaces = 0; i > 0 && spaces < 3;)
+		if (payload[--i] == ' ')
+			spaces++;
+	if (i == 0 || payload[i] != ' ' ||
+		filter_parse(payload + i + 1, *len - i - 1, f) < 0)
+		return false;
+	*len = i;
+	payload[i] = '\0';
+	return true;
+}
+
+int registry_init(client_registry_t *r)
+{
+	r->slots = calloc(REGISTRY_INIT, sizeof(*r->slots));
+	if (!r->slots)
+		return -1;
+	r->cap = REGISTRY_INIT;
+	r->count = 0;
+	return 0;
+}
+
+client_t *registry_find(const client_registry_t *r, const char *id)
+{
+	uint32_t h = seg_hash(id, strlen(id));
+	for (unsigned int i = h & (r->cap - 1);; i = (i + 1) & (r->cap - 1)) {
+		client_t *c = r->slots[i];
+		if (!c)
+			return NULL;
+		if (c->id_hash == h && strcmp(c->id, id) == 0)
+			return c;
+	}
+}
+
+// place c in the first free slot of its probe sequence
+static void registry_insert(client_t **slots, unsigned int cap, client_t *c)
+{
+	unsigned int i = c->id_hash & (cap - 1);
+	while (slots[i])
+		i = (i + 1) & (cap - 1);
+	slots[i] = c;
+}
+
+int registry_reserve(client_registry_t *r, unsigned int count)
+{
+	unsigned int cap = r->cap;
+	while ((unsigned long)count * 4 > (unsigned long)cap * 3)
+		cap *= 2;
+	if (cap == r->cap)
+		return 0;
+
+	client_t **slots = calloc(cap, sizeof(*slots));
+	if (!slots)
+		return -1;
+	for (unsigned int i = 0; i < r->cap; i++)
+		if (r->slots[i])
+			registry_insert(slots, cap, r->slots[i]);
+	free(r->slots);
+	r->slots = slots;
+	r->cap = cap;
+	return 0;
+}
+
+int registry_add(client_registry_t *r, client_t *c)
+{
+	if (registry_reserve(r, r->count + 1) < 0)
+		return -1;
+
+	registry_insert(r->slots, r->cap, c);
+	r->count++;
+	return 0;
+}
+
+void registry_destroy(client_registry_t *r, topic_node_t *root)
+{
+	for (unsigned int i = 0; i < r->cap; i++)
+		if (r->slots[i])
+			client_destroy(root, r->slots[i]);
+	free(r->slots);
+	r->slots = NULL;
+	r->cap = r->count = 0;
+}
+
 int client_handle_data(topic_node_t *root, client_t *c)
 {
 	const size_t HDR_SIZE = sizeof(uint16_t) + sizeof(uint32_t);
@@ -38,7 +779,10 @@ int client_handle_data(topic_node_t *root, client_t *c)
 					 c->read_buf + c->read_buf_len,
 					 READ_BUF_SIZE - c->read_buf_len,
 					 0);
-	if (r <= 0) {
+	if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return 0;
+	// (a worker's kick shows up here as a hangup instead)
+	if (r <= 0 || (!c->worker && c->closing)) {
 		// disconnected or error
 		return -1;
 	}
@@ -76,19 +820,35 @@ int client_handle_data(topic_node_t *root, client_t *c)
 		char *payload = c->read_buf + off + HDR_SIZE;
 		payload[len] = '\0';
 		switch (type) {
-		case MSG_SUBSCRIBE:
-			if (trie_subscribe(root, c, payload) < 0)
-				return -1;
-			if (send_message(c->fd, MSG_SUBSCRIBE_ACK, payload, len) < 0)
+		case MSG_SUBSCRIBE: {
+			// "pattern [TYPE OP constant] [0|1]": a filter constant
+			// of 0 or 1 is not a flag, so look for the filter first
+			uint32_t plen = len;
+			value_filter_t filter;
+			bool sf = false;
+			bool filtered = parse_value_filter(payload, &plen, &filter);
+			if (!filtered) {
+				sf = parse_sf_flag(payload, &plen);
+				filtered = parse_value_filter(payload, &plen, &filter);
+			}
+			// no memory for the ACK: the subscription still counts
+			frame_t *ack = frame_create(MSG_SUBSCRIBE_ACK, payload, plen);
+			int ret = trie_subscribe(root, c, payload, sf,
+									 filtered ? &filter : NULL, ack);
+			frame_release(ack);
+			if (ret < 0)
 				return -1;
 			break;
+		}
 
-		case MSG_UNSUBSCRIBE:
-			if (trie_unsubscribe(root, c, payload) < 0)
-				return -1;
-			if (send_message(c->fd, MSG_UNSUBSCRIBE_ACK, payload, len) < 0)
+		case MSG_UNSUBSCRIBE: {
+			frame_t *ack = frame_create(MSG_UNSUBSCRIBE_ACK, payload, len);
+			int ret = trie_unsubscribe(root, c, payload, ack);
+			frame_release(ack);
+			if (ret < 0)
 				return -1;
 			break;
+		}
 
 		default:
 			// ignore unknown types
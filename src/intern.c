@@ -0,0 +1,132 @@
+// 324CC Stefan CALMAC
+#include "../include/intern.h"
+#include "../include/slab.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// open-addressing table of atoms, linear probing, NULL = free slot
+static struct {
+	atom_t **slots;
+	unsigned int cap;		// power of two
+	unsigned int count;
+	unsigned long interns, intern_hits;
+} atoms;
+
+uint32_t seg_hash(const char *s, size_t len)
+{
+	uint32_t h = 2166136261u;
+	for (size_t i = 0; i < len; i++) {
+		h ^= (uint8_t)s[i];
+		h *= 16777619u;
+	}
+	return h;
+}
+
+size_t atom_size(size_t len)
+{
+	return sizeof(atom_t) + len + 1;
+}
+
+// slot holding str, or the free slot where it would go
+atom_t **atom_slot(const char *str, size_t len, uint32_t hash)
+{
+	unsigned int mask = atoms.cap - 1;
+	unsigned int i = hash & mask;
+	for (; atoms.slots[i]; i = (i + 1) & mask) {
+		atom_t *a = atoms.slots[i];
+		if (a->hash == hash && a->len == len && memcmp(a->str, str, len) == 0)
+			break;
+	}
+	return &atoms.slots[i];
+}
+
+int atom_table_grow(void)
+{
+	unsigned int cap = atoms.cap ? atoms.cap * 2 : INTERN_TABLE_INIT;
+	atom_t **slots = calloc(cap, sizeof(*slots));
+	if (!slots)
+		return -1;
+
+	unsigned int mask = cap - 1;
+	for (unsigned int i = 0; i < atoms.cap; i++) {
+		atom_t *a = atoms.slots[i];
+		if (!a)
+			continue;
+		unsigned int j = a->hash & mask;
+		while (slots[j])
+			j = (j + 1) & mask;
+		slots[j] = a;
+	}
+	free(atoms.slots);
+	atoms.slots = slots;
+	atoms.cap = cap;
+	return 0;
+}
+
+atom_t *atom_intern(const char *str, size_t len, uint32_t hash)
+{
+	atoms.interns++;
+	if ((atoms.count + 1) * 4 > atoms.cap * 3 && atom_table_grow() < 0)
+		return NULL;
+
+	atom_t **slot = atom_slot(str, len, hash);
+	if (*slot) {
+		atoms.intern_hits++;
+		(*slot)->refs++;
+		return *slot;
+	}
+
+	atom_t *a = arena_alloc(atom_size(len));
+	if (!a)
+		return NULL;
+	a->hash = hash;
+	a->len = len;
+	a->refs = 1;
+	memcpy(a->str, str, len);
+	a->str[len] = '\0';
+
+	*slot = a;
+	atoms.count++;
+	return a;
+}
+
+// read-only, so matching threads may look up concurrently; they count
+// their hits in their own match context
+atom_t *atom_lookup(const char *str, size_t len, uint32_t hash)
+{
+	if (!atoms.cap)
+		return NULL;
+	return *atom_slot(str, len, hash);
+}
+
+void atom_release(atom_t *a)
+{
+	if (!a || --a->refs > 0)
+		return;
+
+	// backward-shift deletion keeps probe chains intact
+	unsigned int mask = atoms.cap - 1;
+	unsigned int i = atom_slot(a->str, a->len, a->hash) - atoms.slots;
+	for (unsigned int j = (i + 1) & mask; atoms.slots[j]; j = (j + 1) & mask) {
+		unsigned int k = atoms.slots[j]->hash & mask;
+		// leave entries whose home slot lies cyclically in (i, j]
+		if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+			continue;
+		atoms.slots[i] = atoms.slots[j];
+		i = j;
+	}
+	atoms.slots[i] = NULL;
+	atoms.count--;
+
+	arena_free(a, atom_size(a->len));
+}
+
+void atom_print_stats(FILE *out)
+{
+	fprintf(out,
+			"atoms: %u interned in %u slots, intern hits %lu/%lu (%.1f%%)\n",
+			atoms.count, atoms.cap,
+			atoms.intern_hits, atoms.interns,
+			atoms.interns ? 100.0 * atoms.intern_hits / atoms.interns : 0.0);
+}
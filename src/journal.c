@@ -0,0 +1,493 @@
+// 324CC Stefan CALMAC
+#define _GNU_SOURCE // scandir filter prototypes
+#include "../include/journal.h"
+#include "../include/clock.h"
+#include "../include/intern.h"
+
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// what a record says
+enum {
+	JREC_PUBLISH = 1,	// frame bytes kept for the named clients
+	JREC_CONSUMED		// the named client had everything before replayed
+};
+
+// record header, followed by nids NUL-padded IDs, then len data bytes,
+// the whole padded to 8. size is written last and 0 ends a segment
+typedef struct jrec {
+	uint32_t size;
+	uint32_t sum;			// seg_hash of everything after the header
+	uint16_t kind;
+	uint16_t nids;
+	uint32_t len;
+} jrec_t;
+
+static void seg_path(const journal_t *j, uint32_t seq, char *buf, size_t n)
+{
+	snprintf(buf, n, "%s/journal-%08u.seg", j->dir, seq);
+}
+
+static void seg_unmap(journal_seg_t *s)
+{
+	munmap(s->map, s->size);
+	close(s->fd);
+	free(s);
+}
+
+// map an existing or new segment file, growing it to at least size
+journal_seg_t *seg_map(const char *path, uint32_t seq, size_t size)
+{
+	journal_seg_t *s = calloc(1, sizeof(*s));
+	if (!s)
+		return NULL;
+	s->seq = seq;
+	s->fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (s->fd < 0) {
+		perror("open journal segment");
+		free(s);
+		return NULL;
+	}
+
+	struct stat st;
+	if (fstat(s->fd, &st) < 0 ||
+		((size_t)st.st_size < size && ftruncate(s->fd, size) < 0)) {
+		perror("size journal segment");
+		close(s->fd);
+		free(s);
+		return NULL;
+	}
+	s->size = (size_t)st.st_size > size ? (size_t)st.st_size : size;
+	s->map = mmap(NULL, s->size, PROT_READ | PROT_WRITE, MAP_SHARED,
+				  s->fd, 0);
+	if (s->map == MAP_FAILED) {
+		perror("mmap journal segment");
+		close(s->fd);
+		free(s);
+		return NULL;
+	}
+	return s;
+}
+
+static inline uint32_t rec_sum(const jrec_t *r, uint32_t size)
+{
+	return seg_hash((const char *)(r + 1), size - sizeof(*r));
+}
+
+// the record at off, NULL at the end of the segment's valid records
+static const jrec_t *rec_at(const journal_seg_t *s, size_t off)
+{
+	if (off + sizeof(jrec_t) > s->size)
+		return NULL;
+	const jrec_t *r = (const jrec_t *)(s->map + off);
+	uint32_t size = __atomic_load_n(&r->size, __ATOMIC_ACQUIRE);
+	if (size < sizeof(*r) || (size & 7) || off + size > s->size)
+		return NULL;
+	size_t need = sizeof(*r) + (size_t)r->nids * JOURNAL_ID_LEN + r->len;
+	if (need > size)
+		return NULL;
+	return r;
+}
+
+static inline const char *rec_id(const jrec_t *r, unsigned int i)
+{
+	return (const char *)(r + 1) + (size_t)i * JOURNAL_ID_LEN;
+}
+
+static bool rec_names(const jrec_t *r, const char *id)
+{
+	for (unsigned int i = 0; i < r->nids; i++)
+		if (strncmp(rec_id(r, i), id, JOURNAL_ID_LEN) == 0)
+			return true;
+	return false;
+}
+
+// find the valid records of s (torn or corrupt ones end it)
+static void seg_scan(journal_seg_t *s, journal_visit_fn visit, void *arg)
+{
+	size_t off = 0;
+	const jrec_t *r;
+	while ((r = rec_at(s, off)) && rec_sum(r, r->size) == r->sum) {
+		journal_pos_t pos = {s->seq, off};
+		for (unsigned int i = 0; visit && i < r->nids; i++) {
+			char id[JOURNAL_ID_LEN + 1];
+			memcpy(id, rec_id(r, i), JOURNAL_ID_LEN);
+			id[JOURNAL_ID_LEN] = '\0';
+			visit(arg, id, pos, r->kind == JREC_CONSUMED);
+		}
+		off += r->size;
+	}
+	s->used = off;
+	// whatever follows is garbage now: make it the end marker
+	if (off + sizeof(uint32_t) <= s->size)
+		memset(s->map + off, 0, sizeof(uint32_t));
+}
+
+static int segs_push(journal_t *j, journal_seg_t *s)
+{
+	if (j->nsegs == j->seg_cap) {
+		unsigned int cap = j->seg_cap ? j->seg_cap * 2 : 8;
+		journal_seg_t **segs = realloc(j->segs, cap * sizeof(*segs));
+		if (!segs)
+			return -1;
+		j->segs = segs;
+		j->seg_cap = cap;
+	}
+	j->segs[j->nsegs++] = s;
+	return 0;
+}
+
+static inline journal_seg_t *tail_seg(journal_t *j)
+{
+	return j->segs[j->nsegs - 1];
+}
+
+static journal_seg_t *seg_of(journal_t *j, uint32_t seq)
+{
+	if (!j->nsegs || seq < j->segs[0]->seq)
+		return NULL;
+	uint32_t i = seq - j->segs[0]->seq;
+	return i < j->nsegs ? j->segs[i] : NULL;
+}
+
+// force the tail's unsynced records to disk
+static void tail_msync(journal_t *j)
+{
+	journal_seg_t *t = tail_seg(j);
+	if (t->used <= j->synced)
+		return;
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t from = j->synced & ~(page - 1);
+	if (msync(t->map + from, t->used - from, MS_SYNC) < 0)
+		perror("msync journal");
+	j->synced = t->used;
+	j->last_sync = now_ms();
+	j->syncs++;
+}
+
+// start segment seq, reusing a spare file if there is one
+static int seg_roll(journal_t *j)
+{
+	uint32_t seq = tail_seg(j)->seq + 1;
+	char path[sizeof(j->dir) + 32];
+	seg_path(j, seq, path, sizeof(path));
+
+	if (j->sync != JOURNAL_SYNC_NONE)
+		tail_msync(j);
+
+	journal_seg_t *s = NULL;
+	if (j->nspares) {
+		s = j->spares[--j->nspares];
+		char old[sizeof(path)];
+		seg_path(j, s->seq, old, sizeof(old));
+		if (rename(old, path) < 0) {
+			perror("rename journal segment");
+			unlink(old);
+			seg_unmap(s);
+			s = NULL;
+		} else {
+			s->seq = seq;
+		}
+	}
+	if (!s && !(s = seg_map(path, seq, j->seg_size)))
+		return -1;
+
+	s->used = 0;
+	s->cursors = 0;
+	memset(s->map, 0, sizeof(uint32_t));
+	if (segs_push(j, s) < 0) {
+		seg_unmap(s);
+		unlink(path);
+		return -1;
+	}
+	j->synced = 0;
+	return 0;
+}
+
+// recycle the oldest segments while no cursor needs them
+static void journal_trim(journal_t *j)
+{
+	if (j->recovering)
+		return;
+	unsigned int dead = 0;
+	while (dead < j->nsegs - 1 && j->segs[dead]->cursors == 0)
+		dead++;
+	if (!dead)
+		return;
+
+	for (unsigned int i = 0; i < dead; i++) {
+		journal_seg_t *s = j->segs[i];
+		j->recycled++;
+		// emptied right away: a restart must not replay it again
+		memset(s->map, 0, sizeof(uint32_t));
+		if (j->nspares < JOURNAL_SPARES) {
+			j->spares[j->nspares++] = s;
+			continue;
+		}
+		char path[sizeof(j->dir) + 32];
+		seg_path(j, s->seq, path, sizeof(path));
+		unlink(path);
+		seg_unmap(s);
+	}
+	memmove(j->segs, j->segs + dead, (j->nsegs - dead) * sizeof(*j->segs));
+	j->nsegs -= dead;
+}
+
+static int seg_file_filter(const struct dirent *d)
+{
+	unsigned int seq;
+	char tail;
+	return sscanf(d->d_name, "journal-%8u.se%c", &seq, &tail) == 2 &&
+		   tail == 'g';
+}
+
+int journal_open(journal_t *j, const char *dir, size_t seg_size,
+				 journal_sync_t sync, unsigned int interval_ms,
+				 journal_visit_fn visit, void *arg)
+{
+	memset(j, 0, sizeof(*j));
+	pthread_mutex_init(&j->lock, NULL);
+	snprintf(j->dir, sizeof(j->dir), "%s", dir);
+	j->seg_size = seg_size;
+	j->sync = sync;
+	j->interval_ms = interval_ms;
+	j->last_sync = now_ms();
+
+	if (mkdir(dir, 0755) < 0 && errno != EEXIST) {
+		perror("mkdir journal");
+		return -1;
+	}
+
+	struct dirent **names;
+	int n = scandir(dir, &names, seg_file_filter, alphasort);
+	if (n < 0) {
+		perror("scandir journal");
+		return -1;
+	}
+
+	// map the segments left by the last run; only the run after the
+	// newest gap in the numbering is usable
+	int ret = 0;
+	for (int i = 0; i < n; i++) {
+		char path[sizeof(j->dir) + 32];
+		unsigned int seq;
+		sscanf(names[i]->d_name, "journal-%8u", &seq);
+		snprintf(path, sizeof(path), "%s/%s", dir, names[i]->d_name);
+		free(names[i]);
+		if (ret < 0)
+			continue;
+
+		if (j->nsegs && seq != tail_seg(j)->seq + 1) {
+			fprintf(stderr, "journal: segment %u missing, dropping older\n",
+					tail_seg(j)->seq + 1);
+			for (unsigned int k = 0; k < j->nsegs; k++) {
+				char old[sizeof(path)];
+				seg_path(j, j->segs[k]->seq, old, sizeof(old));
+				unlink(old);
+				seg_unmap(j->segs[k]);
+			}
+			j->nsegs = 0;
+		}
+		journal_seg_t *s = seg_map(path, seq, seg_size);
+		if (!s || segs_push(j, s) < 0)
+			ret = -1;
+	}
+	free(names);
+	if (ret < 0)
+		return -1;
+
+	if (!j->nsegs) {
+		char path[sizeof(j->dir) + 32];
+		seg_path(j, 1, path, sizeof(path));
+		journal_seg_t *s = seg_map(path, 1, seg_size);
+		if (!s || segs_push(j, s) < 0)
+			return -1;
+		memset(s->map, 0, sizeof(uint32_t));
+	}
+
+	j->recovering = true;
+	for (unsigned int i = 0; i < j->nsegs; i++)
+		seg_scan(j->segs[i], visit, arg);
+	j->recovering = false;
+	j->synced = tail_seg(j)->used;
+	journal_trim(j);
+	return 0;
+}
+
+void journal_close(journal_t *j)
+{
+	if (!j->nsegs)
+		return;
+	tail_msync(j);
+	for (unsigned int i = 0; i < j->nsegs; i++)
+		seg_unmap(j->segs[i]);
+	for (unsigned int i = 0; i < j->nspares; i++) {
+		char path[sizeof(j->dir) + 32];
+		seg_path(j, j->spares[i]->seq, path, sizeof(path));
+		unlink(path);
+		seg_unmap(j->spares[i]);
+	}
+	free(j->segs);
+	j->segs = NULL;
+	j->nsegs = j->nspares = 0;
+	pthread_mutex_destroy(&j->lock);
+}
+
+void journal_lock(journal_t *j)
+{
+	pthread_mutex_lock(&j->lock);
+}
+
+void journal_unlock(journal_t *j)
+{
+	pthread_mutex_unlock(&j->lock);
+}
+
+// write one record at the tail, rolling to a new segment if needed
+static journal_pos_t rec_append(journal_t *j, uint16_t kind,
+								const struct iovec *iov, unsigned int niov,
+								const char *const *ids, unsigned int n)
+{
+	journal_pos_t none = {0, 0};
+	size_t len = 0;
+	for (unsigned int i = 0; i < niov; i++)
+		len += iov[i].iov_len;
+	if (len > UINT32_MAX)
+		return none;
+	size_t size = sizeof(jrec_t) + (size_t)n * JOURNAL_ID_LEN + len;
+	size = (size + 7) & ~(size_t)7;
+	// room for the record and the end marker behind it
+	if (size + sizeof(uint32_t) > j->seg_size)
+		return none;
+
+	journal_seg_t *t = tail_seg(j);
+	if (t->used + size + sizeof(uint32_t) > t->size) {
+		if (seg_roll(j) < 0)
+			return none;
+		journal_trim(j);
+		t = tail_seg(j);
+	}
+
+	// end marker first, so a crash mid-record leaves a clean end
+	char *p = t->map + t->used;
+	memset(p + size, 0, sizeof(uint32_t));
+	jrec_t *r = (jrec_t *)p;
+	r->kind = kind;
+	r->nids = n;
+	r->len = len;
+	char *q = (char *)(r + 1);
+	for (unsigned int i = 0; i < n; i++, q += JOURNAL_ID_LEN)
+		strncpy(q, ids[i], JOURNAL_ID_LEN);
+	for (unsigned int i = 0; i < niov; i++) {
+		memcpy(q, iov[i].iov_base, iov[i].iov_len);
+		q += iov[i].iov_len;
+	}
+	memset(q, 0, p + size - q);
+	r->sum = rec_sum(r, size);
+	__atomic_store_n(&r->size, (uint32_t)size, __ATOMIC_RELEASE);
+
+	journal_pos_t pos = {t->seq, (uint32_t)t->used};
+	t->used += size;
+	j->appended_bytes += size;
+	return pos;
+}
+
+journal_pos_t journal_append(journal_t *j,
+							 const struct iovec *iov, unsigned int niov,
+							 const char *const *ids, unsigned int n)
+{
+	journal_pos_t first = {0, 0};
+	for (unsigned int i = 0; i < n; i += JOURNAL_MAX_IDS) {
+		unsigned int k = n - i < JOURNAL_MAX_IDS ? n - i : JOURNAL_MAX_IDS;
+		journal_pos_t pos = rec_append(j, JREC_PUBLISH, iov, niov, ids + i, k);
+		if (!pos.seg)
+			return pos;
+		if (!first.seg)
+			first = pos;
+		j->appended++;
+	}
+	return first;
+}
+
+int journal_consumed(journal_t *j, const char *id)
+{
+	return rec_append(j, JREC_CONSUMED, NULL, 0, &id, 1).seg ? 0 : -1;
+}
+
+long journal_replay(journal_t *j, journal_pos_t *pos, const char *id,
+					journal_replay_fn fn, void *arg)
+{
+	long n = 0;
+	size_t scanned = 0;
+	for (journal_seg_t *s = seg_of(j, pos->seg); s; s = seg_of(j, s->seq + 1)) {
+		size_t off = s->seq == pos->seg ? pos->off : 0;
+		const jrec_t *r;
+		while (off < s->used && (r = rec_at(s, off))) {
+			bool mine = r->kind == JREC_PUBLISH && rec_names(r, id);
+			if (scanned >= JOURNAL_REPLAY_SCAN ||
+				(mine && fn(arg, rec_id(r, r->nids), r->len))) {
+				*pos = (journal_pos_t){s->seq, (uint32_t)off};
+				j->replayed += n;
+				return n;
+			}
+			n += mine;
+			scanned += r->size;
+			off += r->size;
+		}
+	}
+	*pos = (journal_pos_t){0, 0};
+	j->replayed += n;
+	return n;
+}
+
+void journal_cursor_add(journal_t *j, journal_pos_t pos)
+{
+	journal_seg_t *s = seg_of(j, pos.seg);
+	if (s)
+		s->cursors++;
+}
+
+void journal_cursor_drop(journal_t *j, journal_pos_t pos)
+{
+	journal_seg_t *s = seg_of(j, pos.seg);
+	if (s && s->cursors) {
+		s->cursors--;
+		journal_trim(j);
+	}
+}
+
+long journal_sync(journal_t *j)
+{
+	if (j->sync == JOURNAL_SYNC_NONE)
+		return -1;
+	journal_lock(j);
+	long now = now_ms();
+	if (j->sync == JOURNAL_SYNC_BATCH ||
+		now - j->last_sync >= j->interval_ms)
+		tail_msync(j);
+	long due = -1;
+	if (tail_seg(j)->used > j->synced)
+		due = j->last_sync + j->interval_ms - now;
+	journal_unlock(j);
+	return due;
+}
+
+void journal_print_stats(journal_t *j, FILE *out)
+{
+	journal_lock(j);
+	unsigned long held = 0;
+	for (unsigned int i = 0; i < j->nsegs; i++)
+		held += j->segs[i]->used;
+	fprintf(out,
+			"journal: %lu records (%lu B) appended, %lu replayed, "
+			"%u segments (%lu B held), %lu recycled, %lu syncs\n",
+			j->appended, j->appended_bytes, j->replayed,
+			j->nsegs, held, j->recycled, j->syncs);
+	journal_unlock(j);
+}
@@ -0,0 +1,279 @@
+// 324CC Stefan CALMAC
+#include "../include/payload.h"
+
+#include <arpa/inet.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+// longest filter constant accepted, e.g. "-1234567890.123"
+#define FILTER_CONST_MAX 63
+
+static const char *const type_names[] = {
+	[PAYLOAD_INT] = "INT",
+	[PAYLOAD_SHORT_REAL] = "SHORT_REAL",
+	[PAYLOAD_FLOAT] = "FLOAT",
+};
+
+static const char *const op_names[] = {
+	[FILTER_LT] = "<",
+	[FILTER_LE] = "<=",
+	[FILTER_GT] = ">",
+	[FILTER_GE] = ">=",
+	[FILTER_EQ] = "==",
+	[FILTER_NE] = "!=",
+};
+
+// powers of ten a double holds exactly, so m / 10^exp is correctly
+// rounded (and equal decimals decode equal) up to exp 22
+static const double pow10_exact[] = {
+	1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+	1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+#define POW10_EXACT_MAX 22
+
+// "00" .. "99", two digits per division
+static const char digit_pairs[201] =
+	"00010203040506070809101112131415161718192021222324252627282930313233"
+	"34353637383940414243444546474849505152535455565758596061626364656667"
+	"68697071727374757677787980818283848586878889909192939495969798"
+	"99";
+
+// the digits of v, right-aligned in buf[10]; returns the first one
+static char *u32_digits(char buf[10], uint32_t v)
+{
+	char *p = buf + 10;
+	while (v >= 100) {
+		uint32_t q = v / 100;
+		p -= 2;
+		memcpy(p, digit_pairs + 2 * (v - q * 100), 2);
+		v = q;
+	}
+	if (v >= 10) {
+		p -= 2;
+		memcpy(p, digit_pairs + 2 * v, 2);
+	} else {
+		*--p = '0' + v;
+	}
+	return p;
+}
+
+char *fmt_u32(char *out, uint32_t v)
+{
+	char buf[10];
+	char *p = u32_digits(buf, v);
+	size_t n = buf + 10 - p;
+	memcpy(out, p, n);
+	return out + n;
+}
+
+char *fmt_fixed(char *out, uint32_t m, unsigned int exp)
+{
+	char buf[10];
+	char *p = u32_digits(buf, m);
+	size_t n = buf + 10 - p;
+	if (exp == 0) {
+		memcpy(out, p, n);
+		return out + n;
+	}
+
+	if (n > exp) {
+		// integer digits, then the point inside the mantissa
+		memcpy(out, p, n - exp);
+		out += n - exp;
+		*out++ = '.';
+		memcpy(out, p + n - exp, exp);
+		return out + exp;
+	}
+
+	// subunitary: "0." and the zeros before the mantissa's digits
+	*out++ = '0';
+	*out++ = '.';
+	memset(out, '0', exp - n);
+	out += exp - n;
+	memcpy(out, p, n);
+	return out + n;
+}
+
+static char *put(char *out, const char *s, size_t n)
+{
+	memcpy(out, s, n);
+	return out + n;
+}
+
+#define PUT_LIT(out, lit) put(out, lit, sizeof(lit) - 1)
+
+int payload_format(char *out, const char *payload, size_t len,
+				   const char **err)
+{
+	if (len < 1) {
+		*err = "Empty payload";
+		return -1;
+	}
+	uint8_t type = payload[0];
+	const char *p = payload + 1;
+	size_t remain = len - 1;
+	char *o = out;
+
+	switch (type) {
+	case PAYLOAD_INT: {
+		if (remain < 5) {
+			*err = "Payload too short for INT";
+			return -1;
+		}
+		uint32_t netv;
+		memcpy(&netv, p + 1, 4);
+		uint32_t v = ntohl(netv);
+		o = PUT_LIT(o, "INT - ");
+		if (p[0] && v)
+			*o++ = '-';
+		o = fmt_u32(o, v);
+		break;
+	}
+	case PAYLOAD_SHORT_REAL: {
+		if (remain < 2) {
+			*err = "Payload too short for SHORT_REAL";
+			return -1;
+		}
+		uint16_t netsh;
+		memcpy(&netsh, p, 2);
+		o = PUT_LIT(o, "SHORT_REAL - ");
+		o = fmt_fixed(o, ntohs(netsh), 2);
+		break;
+	}
+	case PAYLOAD_FLOAT: {
+		if (remain < 6) {
+			*err = "Payload too short for FLOAT";
+			return -1;
+		}
+		uint32_t netm;
+		memcpy(&netm, p + 1, 4);
+		uint32_t m = ntohl(netm);
+		o = PUT_LIT(o, "FLOAT - ");
+		if (p[0] && m)
+			*o++ = '-';
+		o = fmt_fixed(o, m, (uint8_t)p[5]);
+		break;
+	}
+	case PAYLOAD_STRING:
+		o = PUT_LIT(o, "STRING - ");
+		o = put(o, p, strnlen(p, remain));
+		break;
+	default:
+		*err = "Unknown payload type";
+		return -1;
+	}
+
+	*o++ = '\n';
+	return o - out;
+}
+
+void payload_decode(const char *payload, size_t len, payload_value_t *v)
+{
+	v->type = -1;
+	v->num = 0;
+	if (len < 1)
+		return;
+	const char *p = payload + 1;
+	size_t remain = len - 1;
+
+	switch ((uint8_t)payload[0]) {
+	case PAYLOAD_INT: {
+		if (remain < 5)
+			return;
+		uint32_t netv;
+		memcpy(&netv, p + 1, 4);
+		v->num = p[0] ? -(double)ntohl(netv) : (double)ntohl(netv);
+		break;
+	}
+	case PAYLOAD_SHORT_REAL: {
+		if (remain < 2)
+			return;
+		uint16_t netsh;
+		memcpy(&netsh, p, 2);
+		v->num = ntohs(netsh) / 100.0;
+		break;
+	}
+	case PAYLOAD_FLOAT: {
+		if (remain < 6)
+			return;
+		uint32_t netm;
+		memcpy(&netm, p + 1, 4);
+		double num = ntohl(netm);
+		unsigned int exp = (uint8_t)p[5];
+		for (; exp > POW10_EXACT_MAX; exp -= POW10_EXACT_MAX)
+			num /= pow10_exact[POW10_EXACT_MAX];
+		num /= pow10_exact[exp];
+		v->num = p[0] ? -num : num;
+		break;
+	}
+	case PAYLOAD_STRING:
+		break;
+	default:
+		return;
+	}
+	v->type = (uint8_t)payload[0];
+}
+
+// index of the name equal to s[0..len) in names[0..n), -1 if none
+static int name_index(const char *const *names, int n,
+					  const char *s, size_t len)
+{
+	for (int i = 0; i < n; i++)
+		if (names[i] && strlen(names[i]) == len && !memcmp(names[i], s, len))
+			return i;
+	return -1;
+}
+
+int filter_parse(const char *s, size_t len, value_filter_t *f)
+{
+	// three tokens, one space apart
+	const char *end = s + len;
+	const char *sp1 = memchr(s, ' ', len);
+	const char *sp2 = sp1 ? memchr(sp1 + 1, ' ', end - sp1 - 1) : NULL;
+	if (!sp2)
+		return -1;
+	const char *k = sp2 + 1;
+	size_t klen = end - k;
+	if (klen == 0 || klen > FILTER_CONST_MAX || memchr(k, ' ', klen))
+		return -1;
+
+	int type = name_index(type_names, PAYLOAD_STRING, s, sp1 - s);
+	int op = name_index(op_names, FILTER_NE + 1, sp1 + 1, sp2 - sp1 - 1);
+	if (type < 0 || op < 0)
+		return -1;
+
+	char num[FILTER_CONST_MAX + 1];
+	memcpy(num, k, klen);
+	num[klen] = '\0';
+	char *rest;
+	double value = strtod(num, &rest);
+	if (*rest || !isfinite(value))
+		return -1;
+
+	f->type = type;
+	f->op = op;
+	f->value = value;
+	return 0;
+}
+
+bool filter_match(const value_filter_t *f, const payload_value_t *v)
+{
+	if (v->type != f->type)
+		return false;
+	switch (f->op) {
+	case FILTER_LT:
+		return v->num < f->value;
+	case FILTER_LE:
+		return v->num <= f->value;
+	case FILTER_GT:
+		return v->num > f->value;
+	case FILTER_GE:
+		return v->num >= f->value;
+	case FILTER_EQ:
+		return v->num == f->value;
+	case FILTER_NE:
+		return v->num != f->value;
+	}
+	return false;
+}
@@ -28,3 +28,191 @@ int send_message(int fd, uint16_t type,
 		return -1;
 	return 0;
 }
+
+rbuf_t *rbuf_create(uint32_t size)
+{
+	rbuf_t *b = malloc(sizeof(*b) + size);
+	if (!b)
+		return NULL;
+	b->refs = 1;
+	b->size = size;
+	return b;
+}
+
+rbuf_t *rbuf_shrink(rbuf_t *b, uint32_t size)
+{
+	rbuf_t *nb = realloc(b, sizeof(*b) + size);
+	if (!nb)
+		return b;
+	nb->size = size;
+	return nb;
+}
+
+rbuf_t *rbuf_ref(rbuf_t *b)
+{
+	__atomic_fetch_add(&b->refs, 1, __ATOMIC_RELAXED);
+	return b;
+}
+
+void rbuf_release(rbuf_t *b)
+{
+	if (b && __atomic_sub_fetch(&b->refs, 1, __ATOMIC_ACQ_REL) == 0)
+		free(b);
+}
+
+// frame whose payload is head[0..head_len) then body[0..body_len); the
+// body is referenced in owner when it is big, copied otherwise
+static frame_t *frame_compose(uint16_t type,
+							  const char *head, uint32_t head_len,
+							  const char *body, uint32_t body_len,
+							  rbuf_t *owner)
+{
+	bool copy = !owner || body_len <= FRAME_COPY_MAX;
+	uint32_t inline_len = head_len + (copy ? body_len : 0);
+	frame_t *f = malloc(sizeof(*f) + sizeof(MsgHeader) + inline_len);
+	if (!f)
+		return NULL;
+
+	MsgHeader hdr;
+	hdr.type = htons(type);
+	hdr.length = htonl(head_len + body_len);
+	memcpy(f->data, &hdr, sizeof(hdr));
+	memcpy(f->data + sizeof(hdr), head, head_len);
+	if (copy)
+		memcpy(f->data + sizeof(hdr) + head_len, body, body_len);
+	f->len = sizeof(hdr) + head_len + body_len;
+	f->head_len = sizeof(hdr) + inline_len;
+	f->body = copy ? NULL : body;
+	f->owner = copy ? NULL : rbuf_ref(owner);
+	f->refs = 1;
+	return f;
+}
+
+frame_t *frame_alloc(uint16_t type, uint32_t len)
+{
+	frame_t *f = malloc(sizeof(*f) + sizeof(MsgHeader) + len);
+	if (!f)
+		return NULL;
+
+	MsgHeader hdr;
+	hdr.type = htons(type);
+	hdr.length = htonl(len);
+	memcpy(f->data, &hdr, sizeof(hdr));
+	f->len = sizeof(hdr) + len;
+	f->head_len = f->len;
+	f->body = NULL;
+	f->owner = NULL;
+	f->refs = 1;
+	return f;
+}
+
+int frame_iov(const frame_t *f, uint32_t off, struct iovec *iov)
+{
+	int n = 0;
+	if (off < f->head_len) {
+		iov[n].iov_base = (char *)f->data + off;
+		iov[n].iov_len = f->head_len - off;
+		n++;
+		off = f->head_len;
+	}
+	if (off < f->len) {
+		iov[n].iov_base = (char *)f->body + (off - f->head_len);
+		iov[n].iov_len = f->len - off;
+		n++;
+	}
+	return n;
+}
+
+frame_t *frame_create(uint16_t type, const void *payload, uint32_t len)
+{
+	frame_t *f = frame_alloc(type, len);
+	if (f && len > 0)
+		memcpy(f->data + sizeof(MsgHeader), payload, len);
+	return f;
+}
+
+// a source's "a.b.c.d port " prefix, len 0 while the slot is unused
+typedef struct {
+	uint32_t addr;		// network order, as in sin_addr / sin_port
+	uint16_t port;
+	uint8_t len;
+	char text[PUB_TEXT_PREFIX_MAX];
+} prefix_slot_t;
+
+// publishers are long-lived sensors sending from a fixed address, so
+// their prefix is formatted once per thread and then only copied. Per
+// thread, no locking is needed with several ingest threads
+static __thread prefix_slot_t prefix_cache[PREFIX_CACHE_SLOTS];
+
+static const prefix_slot_t *source_prefix(const struct sockaddr_in *src)
+{
+	uint32_t addr = src->sin_addr.s_addr;
+	uint16_t port = src->sin_port;
+	uint64_t key = (uint64_t)addr << 16 | port;
+	prefix_slot_t *s = &prefix_cache[(key * 0x9E3779B97F4A7C15ull) >>
+									 (64 - __builtin_ctz(PREFIX_CACHE_SLOTS))];
+	if (s->len && s->addr == addr && s->port == port)
+		return s;
+
+	char ip[INET_ADDRSTRLEN];
+	inet_ntop(AF_INET, &src->sin_addr, ip, sizeof(ip));
+	int n = snprintf(s->text, sizeof(s->text), "%s %u ", ip, ntohs(port));
+	s->addr = addr;
+	s->port = port;
+	s->len = n > 0 && n < (int)sizeof(s->text) ? n : 0;
+	return s;
+}
+
+// "a.b.c.d port " in front of the datagram as received
+static frame_t *encode_text(const publication_t *p)
+{
+	const prefix_slot_t *s = source_prefix(p->src);
+	return frame_compose(MSG_PUBLISH, s->text, s->len,
+						 p->data, p->len, p->buf);
+}
+
+// address, port and topic length, the topic without its padding, then
+// type and value
+static frame_t *encode_binary(const publication_t *p)
+{
+	char head[PUB_BIN_HEADER + MAX_TOPIC_LEN];
+	memcpy(head, &p->src->sin_addr.s_addr, 4);
+	memcpy(head + 4, &p->src->sin_port, 2);
+	head[6] = p->tlen;
+	memcpy(head + PUB_BIN_HEADER, p->data, p->tlen);
+
+	uint32_t vlen = p->len > MAX_TOPIC_LEN ? p->len - MAX_TOPIC_LEN : 0;
+	return frame_compose(MSG_PUBLISH_BIN, head, PUB_BIN_HEADER + p->tlen,
+						 p->data + MAX_TOPIC_LEN, vlen, p->buf);
+}
+
+frame_t *publication_frame(publication_t *p, pub_format_t fmt)
+{
+	if (!p->frames[fmt])
+		p->frames[fmt] = fmt == PUB_BINARY ? encode_binary(p)
+										   : encode_text(p);
+	return p->frames[fmt];
+}
+
+void publication_release(publication_t *p)
+{
+	for (int i = 0; i < PUB_FORMATS; i++) {
+		frame_release(p->frames[i]);
+		p->frames[i] = NULL;
+	}
+}
+
+frame_t *frame_ref(frame_t *f)
+{
+	__atomic_fetch_add(&f->refs, 1, __ATOMIC_RELAXED);
+	return f;
+}
+
+void frame_release(frame_t *f)
+{
+	// frames are shared with delivery workers, hence atomic
+	if (f && __atomic_sub_fetch(&f->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		rbuf_release(f->owner);
+		free(f);
+	}
+}
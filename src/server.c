@@ -1,143 +1,596 @@
 // 324CC Stefan CALMAC
+#define _GNU_SOURCE // recvmmsg
 #include "../include/client_server.h"
+#include "../include/clock.h"
 #include "../include/protocol.h"
+#include "../include/snapshot.h"
 #include "../include/topic_trie.h"
+#include "../include/worker.h"
+
+#include <pthread.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#define MAX_EVENTS 64
+#define DEFAULT_UDP_BATCH 32
+#define MAX_UDP_BATCH 1024
+// UDP reactor threads; each needs a match context besides the main one
+#define MAX_INGEST (MAX_MATCH_CTX - 1)
+// longest ID line: the ID and its options, e.g. " bin"
+#define HANDSHAKE_LINE 32
+// connections waiting for their ID line; more wait in the listen backlog
+#define MAX_HANDSHAKES 4096
+// how long a connection may take to send its ID line
+#define HANDSHAKE_TIMEOUT_MS 5000
+// how often a running background snapshot is checked on
+#define SNAPSHOT_REAP_MS 100
+
+typedef struct {
+	unsigned int udp_batch;		// datagrams drained per wakeup
+	size_t out_hwm;				// per-client outbound queue limit
+	out_policy_t out_policy;	// what to do past out_hwm
+	size_t match_cache;			// publish match cache budget, 0 = off
+	unsigned int workers;		// delivery threads, 0 = write inline
+	unsigned int ingest;		// UDP reactor threads, 0 = main reactor
+	unsigned int store_msgs;	// store-and-forward limits per client
+	size_t store_bytes;
+	const char *journal_dir;	// offline messages on disk, NULL = RAM
+	journal_sync_t journal_sync;
+	const char *snapshot;		// trie + registry file, NULL = none
+	unsigned int snapshot_every;	// seconds between snapshots, 0 = exit only
+} server_opts_t;
+
+// preallocated recvmmsg slots, reused on every wakeup
+typedef struct {
+	unsigned int size;
+	struct mmsghdr *msgs;
+	struct iovec *iovs;
+	struct sockaddr_in *addrs;
+	rbuf_t **bufs;				// MAX_UDP_PAYLOAD bytes each
+
+	// ingest counters, dumped by the "stats" command
+	unsigned long wakeups;
+	unsigned long datagrams;
+	unsigned int max_drained;
+} udp_batch_t;
+
+// A UDP reactor thread: its own SO_REUSEPORT socket on the shared
+// port, recvmmsg slots and match context. The kernel picks the socket
+// by hashing the source address/port, so every publisher sticks to
+// one thread and its datagrams stay in order
+typedef struct ingest {
+	pthread_t tid;
+	unsigned int index;
+	int udp_fd;
+	int epfd;
+	int stop_fd;				// eventfd, readable once asked to stop
+	topic_node_t *root;
+	match_ctx_t *ctx;
+	udp_batch_t batch;
+} ingest_t;
+
+// A connection accepted but still waiting for its ID line. It is
+// driven by the reactor (cookie = the slot) until the line is complete
+// or its deadline passes, so a silent peer cannot stall the broker
+typedef struct handshake {
+	int fd;
+	struct sockaddr_in addr;
+	char line[HANDSHAKE_LINE];
+	size_t len;					// bytes of the line received so far
+	long deadline;				// CLOCK_MONOTONIC, ms
+	struct handshake *prev, *next;	// pending FIFO, or free list
+} handshake_t;
+
+typedef struct {
+	handshake_t *slots;			// MAX_HANDSHAKES, epoll cookies
+	handshake_t *free;
+	handshake_t *head, *tail;	// pending, oldest (first deadline) first
+	unsigned int pending;
+	bool paused;				// table full, listen socket unwatched
+} handshake_table_t;
+
+// epoll cookies for the fixed descriptors; client sockets carry their
+// client_t * and handshakes their slot instead, so these only need
+// distinct addresses
+static int stdin_tag, udp_tag, tcp_tag;
+
+// register fd for `events` with `cookie` as its epoll data
+int reactor_add(int epfd, int fd, uint32_t events, void *cookie)
+{
+	struct epoll_event ev = {.events = events, .data.ptr = cookie};
+	if (epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		perror("epoll_ctl ADD");
+		return -1;
+	}
+	return 0;
+}
 
-#include <poll.h>
+// length of the topic at the start of a datagram: up to the first NUL,
+// at most MAX_TOPIC_LEN bytes; the topic is used in place, not copied
+size_t extract_topic(const char *msg, size_t len)
+{
+	return strnlen(msg, len < MAX_TOPIC_LEN ? len : MAX_TOPIC_LEN);
+}
 
-#define MAX_UDP_PAYLOAD 1500
+int udp_batch_init(udp_batch_t *b, unsigned int size)
+{
+	memset(b, 0, sizeof(*b));
+	b->size = size;
+	b->msgs = calloc(size, sizeof(*b->msgs));
+	b->iovs = calloc(size, sizeof(*b->iovs));
+	b->addrs = calloc(size, sizeof(*b->addrs));
+	b->bufs = calloc(size, sizeof(*b->bufs));
+	if (!b->msgs || !b->iovs || !b->addrs || !b->bufs)
+		return -1;
+
+	for (unsigned int i = 0; i < size; i++) {
+		b->bufs[i] = rbuf_create(MAX_UDP_PAYLOAD);
+		if (!b->bufs[i])
+			return -1;
+		b->iovs[i].iov_base = b->bufs[i]->data;
+		b->iovs[i].iov_len = MAX_UDP_PAYLOAD;
+		b->msgs[i].msg_hdr.msg_iov = &b->iovs[i];
+		b->msgs[i].msg_hdr.msg_iovlen = 1;
+		b->msgs[i].msg_hdr.msg_name = &b->addrs[i];
+	}
+	return 0;
+}
 
-ssize_t build_packet(struct sockaddr_in *src,
-					 char *buf,
-					 ssize_t payload_len)
+void udp_batch_free(udp_batch_t *b)
 {
-	char header[INET_ADDRSTRLEN + 1 + 6 + 2];
-	int header_len = snprintf(
-		header, sizeof(header),
-		"%s %u ",
-		inet_ntoa(src->sin_addr),
-		ntohs(src->sin_port));
-	if (header_len < 0 || header_len >= (int)sizeof(header)) {
-		return payload_len;
-	}
-	memmove(buf + header_len, buf, payload_len);
-	memcpy(buf, header, header_len);
-	return header_len + payload_len;
+	free(b->msgs);
+	free(b->iovs);
+	free(b->addrs);
+	for (unsigned int i = 0; b->bufs && i < b->size; i++)
+		rbuf_release(b->bufs[i]);
+	free(b->bufs);
 }
 
-char *extract_topic(char *msg)
+/**
+ * Drains up to b->size datagrams from udp_fd with a single recvmmsg,
+ * then extracts topics and publishes the whole batch; each datagram is
+ * only encoded in the formats its subscribers asked for. A datagram
+ * bigger than FRAME_COPY_MAX is not copied into its frames: its buffer
+ * is shrunk to fit and handed over to them, the slot getting a fresh one.
+ */
+void handle_udp_batch(int udp_fd, udp_batch_t *b, topic_node_t *root)
 {
-	if (!msg)
-		return NULL;
+	// recvmmsg overwrites these with the actual lengths
+	for (unsigned int i = 0; i < b->size; i++)
+		b->msgs[i].msg_hdr.msg_namelen = sizeof(b->addrs[i]);
+
+	int n = recvmmsg(udp_fd, b->msgs, b->size, MSG_DONTWAIT, NULL);
+	if (n < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR)
+			perror("recvmmsg");
+		return;
+	}
+
+	// read by "stats" on the main thread while ingest threads run
+	__atomic_fetch_add(&b->wakeups, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&b->datagrams, n, __ATOMIC_RELAXED);
+	if ((unsigned int)n > b->max_drained)
+		__atomic_store_n(&b->max_drained, n, __ATOMIC_RELAXED);
+
+	for (int i = 0; i < n; i++) {
+		ssize_t len = b->msgs[i].msg_len;
+		if (len <= 0)
+			continue;
+
+		rbuf_t *buf = NULL;
+		if (len > FRAME_COPY_MAX) {
+			rbuf_t *fresh = rbuf_create(MAX_UDP_PAYLOAD);
+			if (fresh) {
+				buf = rbuf_shrink(b->bufs[i], len);
+				b->bufs[i] = fresh;
+				b->iovs[i].iov_base = fresh->data;
+			}
+		}
+
+		const char *data = buf ? buf->data : b->bufs[i]->data;
+		publication_t pub = {
+			.src = &b->addrs[i],
+			.data = data,
+			.len = len,
+			.tlen = extract_topic(data, len),
+			.buf = buf};
+		trie_publish(root, &pub);
+		publication_release(&pub);
+		rbuf_release(buf);
+	}
+	client_store_sync();
+}
+
+void udp_batch_print_stats(const udp_batch_t *b, const char *name)
+{
+	unsigned long datagrams = __atomic_load_n(&b->datagrams, __ATOMIC_RELAXED);
+	unsigned long wakeups = __atomic_load_n(&b->wakeups, __ATOMIC_RELAXED);
+	fprintf(stderr,
+			"%s: %lu datagrams in %lu wakeups (avg %.2f, max %u, batch %u)\n",
+			name, datagrams, wakeups,
+			wakeups ? (double)datagrams / wakeups : 0.0,
+			__atomic_load_n(&b->max_drained, __ATOMIC_RELAXED), b->size);
+}
+
+void print_stats(const udp_batch_t *b,
+				 const ingest_t *ingests,
+				 unsigned int ningest,
+				 journal_t *journal,
+				 const client_registry_t *reg)
+{
+	if (!ningest)
+		udp_batch_print_stats(b, "udp");
+	for (unsigned int i = 0; i < ningest; i++) {
+		char name[32];
+		snprintf(name, sizeof(name), "udp reactor %u", i);
+		udp_batch_print_stats(&ingests[i].batch, name);
+	}
+	trie_print_stats();
+	workers_print_stats();
+	if (journal)
+		journal_print_stats(journal, stderr);
+	for (unsigned int i = 0; i < reg->cap; i++)
+		if (reg->slots[i])
+			client_print_stats(reg->slots[i]);
+}
+
+// UDP socket bound to port; with reuseport several of them share it
+int udp_open(int port, bool reuseport)
+{
+	int one = 1;
+	int fd = socket(AF_INET, SOCK_DGRAM, 0);
+	if (fd < 0) {
+		perror("socket udp");
+		return -1;
+	}
+
+	if (setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0 ||
+		(reuseport &&
+		 setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0)) {
+		perror("setsockopt UDP");
+		close(fd);
+		return -1;
+	}
+
+	struct sockaddr_in addr = {
+		.sin_family = AF_INET,
+		.sin_port = htons(port),
+		.sin_addr.s_addr = INADDR_ANY};
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		perror("bind UDP");
+		close(fd);
+		return -1;
+	}
+	return fd;
+}
+
+void *ingest_main(void *arg)
+{
+	ingest_t *in = arg;
+	struct epoll_event events[2];
+
+	match_ctx_enter(in->ctx);
+	for (;;) {
+		int nev = epoll_wait(in->epfd, events, 2, -1);
+		if (nev < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait ingest");
+			return NULL;
+		}
+		for (int i = 0; i < nev; i++) {
+			if (events[i].data.ptr == &in->stop_fd)
+				return NULL;
+			handle_udp_batch(in->udp_fd, &in->batch, in->root);
+		}
+	}
+}
+
+// open the reactor's socket and start its thread; -1 on error
+int ingest_start(ingest_t *in, unsigned int index, int port,
+				 topic_node_t *root, unsigned int batch)
+{
+	memset(in, 0, sizeof(*in));
+	in->index = index;
+	in->root = root;
+	in->udp_fd = udp_open(port, true);
+	if (in->udp_fd < 0)
+		return -1;
+
+	in->epfd = epoll_create1(EPOLL_CLOEXEC);
+	in->stop_fd = eventfd(0, EFD_CLOEXEC);
+	if (in->epfd < 0 || in->stop_fd < 0) {
+		perror("ingest_start");
+		return -1;
+	}
+	if (reactor_add(in->epfd, in->udp_fd, EPOLLIN, &in->udp_fd) < 0 ||
+		reactor_add(in->epfd, in->stop_fd, EPOLLIN, &in->stop_fd) < 0)
+		return -1;
+
+	if (udp_batch_init(&in->batch, batch) < 0) {
+		perror("udp_batch_init");
+		return -1;
+	}
+	in->ctx = match_ctx_create();
+	if (!in->ctx) {
+		fprintf(stderr, "ingest_start: no match context left\n");
+		return -1;
+	}
+
+	int err = pthread_create(&in->tid, NULL, ingest_main, in);
+	if (err) {
+		fprintf(stderr, "pthread_create: %s\n", strerror(err));
+		return -1;
+	}
+	return 0;
+}
+
+void ingest_stop(ingest_t *in)
+{
+	uint64_t one = 1;
+	if (write(in->stop_fd, &one, sizeof(one)) < 0)
+		perror("write eventfd");
+	pthread_join(in->tid, NULL);
+	udp_batch_free(&in->batch);
+	close(in->stop_fd);
+	close(in->epfd);
+	close(in->udp_fd);
+}
+
+int handshakes_init(handshake_table_t *t)
+{
+	memset(t, 0, sizeof(*t));
+	t->slots = calloc(MAX_HANDSHAKES, sizeof(*t->slots));
+	if (!t->slots)
+		return -1;
+	for (unsigned int i = 0; i < MAX_HANDSHAKES; i++) {
+		t->slots[i].next = t->free;
+		t->free = &t->slots[i];
+	}
+	return 0;
+}
+
+// whether an epoll cookie is one of t's slots
+bool is_handshake(const handshake_table_t *t, const void *cookie)
+{
+	uintptr_t p = (uintptr_t)cookie, base = (uintptr_t)t->slots;
+	return p >= base && p < base + MAX_HANDSHAKES * sizeof(*t->slots);
+}
+
+// take h off the pending list, back to the free list; its socket is
+// closed (which unregisters it) unless it was handed to a client
+void handshake_end(handshake_table_t *t, handshake_t *h,
+				   int epfd, int tcp_fd, bool close_fd)
+{
+	if (close_fd)
+		close(h->fd);
+
+	if (h->prev)
+		h->prev->next = h->next;
+	else
+		t->head = h->next;
+	if (h->next)
+		h->next->prev = h->prev;
+	else
+		t->tail = h->prev;
+	t->pending--;
+
+	h->next = t->free;
+	t->free = h;
+
+	// a slot is free again: take connections off the backlog
+	if (t->paused) {
+		struct epoll_event ev = {.events = EPOLLIN, .data.ptr = &tcp_tag};
+		if (epoll_ctl(epfd, EPOLL_CTL_MOD, tcp_fd, &ev) < 0)
+			perror("epoll_ctl MOD listen");
+		t->paused = false;
+	}
+}
+
+/**
+ * Accepts every pending TCP connection on tcp_fd (non-blocking, until
+ * the backlog is empty) and parks each in a handshake slot until its
+ * ID line arrives. With every slot taken, stops watching the listen
+ * socket; the kernel backlog holds the rest meanwhile.
+ */
+void handle_new_tcp_connections(int epfd, int tcp_fd, handshake_table_t *t)
+{
+	while (t->free) {
+		handshake_t *h = t->free;
+		socklen_t alen = sizeof(h->addr);
+		int fd = accept4(tcp_fd, (struct sockaddr *)&h->addr, &alen,
+						 SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				perror("accept4");
+			return;
+		}
 
-	char *topic = malloc(MAX_TOPIC_LEN + 1);
-	if (!topic)
+		if (reactor_add(epfd, fd, EPOLLIN, h) < 0) {
+			close(fd);
+			continue;
+		}
+		t->free = h->next;
+		h->fd = fd;
+		h->len = 0;
+		h->deadline = now_ms() + HANDSHAKE_TIMEOUT_MS;
+		// constant timeout: appending keeps the list sorted by deadline
+		h->prev = t->tail;
+		h->next = NULL;
+		if (t->tail)
+			t->tail->next = h;
+		else
+			t->head = h;
+		t->tail = h;
+		t->pending++;
+	}
+
+	struct epoll_event ev = {.events = 0, .data.ptr = &tcp_tag};
+	if (epoll_ctl(epfd, EPOLL_CTL_MOD, tcp_fd, &ev) < 0)
+		perror("epoll_ctl MOD listen");
+	t->paused = true;
+}
+
+// the client registered under id, registering a new (inactive) one if
+// there is none; NULL on error
+client_t *client_get(client_registry_t *reg, const char *id)
+{
+	client_t *c = registry_find(reg, id);
+	if (c)
+		return c;
+
+	// Brand-new client, bound to a delivery worker for good
+	c = client_create(id);
+	if (!c)
+		return NULL;
+	if (registry_add(reg, c) < 0) {
+		perror("registry_add");
+		// no socket or subscriptions yet: the trie is left untouched
+		client_destroy(NULL, c);
 		return NULL;
+	}
+	// only once it is registered, so the shard count stays exact
+	c->worker = worker_pick();
+	return c;
+}
 
-	int i;
+/**
+ * Binds a connection that sent its ID to the client registered under
+ * it (registering a brand-new client) and hands the socket over to it,
+ * publishes to be sent in format fmt from now on.
+ * Returns -1 if the socket was not taken (ID already connected, error).
+ */
+int client_connect(int epfd, client_registry_t *reg, int fd,
+				   const struct sockaddr_in *addr, const char *id,
+				   pub_format_t fmt)
+{
+	client_t *c = registry_find(reg, id);
+	if (c && c->state == CLIENT_ACTIVE) {
+		printf("Client %s already connected.\n", id);
+		return -1;
+	}
+	if (!c && !(c = client_get(reg, id)))
+		return -1;
+
+	// before the replay, which sends what is stored in this format
+	client_set_format(c, fmt);
 
-	for (i = 0; i < MAX_TOPIC_LEN && msg[i] != '\0'; i++) {
-		topic[i] = msg[i];
+	// a failed attach leaves the client registered, inactive
+	if (client_attach(c, fd, epfd) < 0) {
+		perror("client_attach");
+		return -1;
 	}
-	topic[i] = '\0';
+	printf("New client %s connected from %s:%d.\n",
+		   c->id,
+		   inet_ntoa(addr->sin_addr),
+		   ntohs(addr->sin_port));
+	return 0;
+}
 
-	return topic;
+// split an ID line into the ID and the publish format its options
+// ask for ("bin"; others are ignored). NULL if the ID does not fit
+const char *parse_id_line(char *line, pub_format_t *fmt)
+{
+	*fmt = PUB_TEXT;
+	char *save;
+	char *id = strtok_r(line, " ", &save);
+	if (!id || strlen(id) >= sizeof(((client_t *)0)->id))
+		return NULL;
+	for (char *opt; (opt = strtok_r(NULL, " ", &save));)
+		if (strcmp(opt, "bin") == 0)
+			*fmt = PUB_BINARY;
+	return id;
 }
 
 /**
- * Accepts one pending TCP connection on tcp_fd, reads the client ID,
- * and links it into either the active or inactive client lists.
+ * Reads what arrived of h's ID line ("<id>[ bin]"). Once the newline
+ * is in, the connection becomes its client's socket; anything behind
+ * the line is left unread for client_handle_data. Drops the connection
+ * on EOF, error or an ID line that does not fit.
  */
-void handle_new_tcp_connection(int tcp_fd,
-							   client_t **clients,
-							   client_t **inactive_clients,
-							   int *client_count)
+void handshake_read(handshake_table_t *t, handshake_t *h,
+					int epfd, int tcp_fd, client_registry_t *reg)
 {
-	struct sockaddr_in cli;
-	socklen_t clilen = sizeof(cli);
-	int newfd = accept(tcp_fd, (struct sockaddr *)&cli, &clilen);
-	if (newfd < 0) {
-		perror("accept");
+	// peek first so only the ID line itself is consumed
+	char *dst = h->line + h->len;
+	size_t room = sizeof(h->line) - h->len;
+	ssize_t r = recv(h->fd, dst, room, MSG_PEEK);
+	if (r < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return;
+	if (r <= 0) {
+		handshake_end(t, h, epfd, tcp_fd, true);
 		return;
 	}
 
-	char id[16];
-	ssize_t len = recv(newfd, id, sizeof(id) - 1, 0);
-	if (len <= 0) {
-		close(newfd);
+	char *nl = memchr(dst, '\n', r);
+	size_t take = nl ? (size_t)(nl - dst) + 1 : (size_t)r;
+	if (recv(h->fd, dst, take, 0) != (ssize_t)take) {
+		handshake_end(t, h, epfd, tcp_fd, true);
 		return;
 	}
-	id[len] = '\0';
-	id[strcspn(id, "\r\n")] = '\0';
+	h->len += take;
 
-	// Check if already active
-	for (client_t *it = *clients; it; it = it->next) {
-		if (strcmp(it->id, id) == 0) {
-			printf("Client %s already connected.\n", id);
-			close(newfd);
-			return;
-		}
+	if (!nl) {
+		// a full buffer and no end in sight: not an ID line
+		if (h->len == sizeof(h->line))
+			handshake_end(t, h, epfd, tcp_fd, true);
+		return;
 	}
 
-	// Look for reconnection in inactive list
-	client_t *prev_in = NULL, *it = *inactive_clients;
-	while (it && strcmp(it->id, id) != 0) {
-		prev_in = it;
-		it = it->next;
+	*nl = '\0';
+	h->line[strcspn(h->line, "\r")] = '\0';
+	pub_format_t fmt;
+	const char *id = parse_id_line(h->line, &fmt);
+	if (!id) {
+		handshake_end(t, h, epfd, tcp_fd, true);
+		return;
 	}
+	// the client registers the socket with the reactor again itself
+	epoll_ctl(epfd, EPOLL_CTL_DEL, h->fd, NULL);
+	bool taken = client_connect(epfd, reg, h->fd, &h->addr, id, fmt) == 0;
+	handshake_end(t, h, epfd, tcp_fd, !taken);
+}
 
-	if (it) {
-		// Reconnect existing client
-		if (prev_in)
-			prev_in->next = it->next;
-		else
-			*inactive_clients = it->next;
-
-		it->fd = newfd;
-		it->read_buf_len = 0;
-		it->next = *clients;
-		*clients = it;
-		(*client_count)++;
-		printf("New client %s connected from %s:%d.\n",
-			   it->id,
-			   inet_ntoa(cli.sin_addr),
-			   ntohs(cli.sin_port));
-	} else {
-		// Brand-new client
-		client_t *nc = client_create(newfd, id);
-		if (!nc) {
-			close(newfd);
-			return;
-		}
-		nc->next = *clients;
-		*clients = nc;
-		(*client_count)++;
-		printf("New client %s connected from %s:%d.\n",
-			   nc->id,
-			   inet_ntoa(cli.sin_addr),
-			   ntohs(cli.sin_port));
-	}
+// drop handshakes past their deadline; returns the epoll_wait timeout
+// until the next one expires (-1: none pending)
+int handshakes_expire(handshake_table_t *t, int epfd, int tcp_fd)
+{
+	if (!t->head)
+		return -1;
+
+	long now = now_ms();
+	while (t->head && t->head->deadline <= now)
+		handshake_end(t, t->head, epfd, tcp_fd, true);
+	return t->head ? (int)(t->head->deadline - now) : -1;
+}
+
+// journal_visit_fn: clients with journaled messages are known from the
+// start, so they get them on their first connect after a restart
+void journal_recover(void *arg, const char *id, journal_pos_t pos,
+					 bool consumed)
+{
+	client_t *c = client_get(arg, id);
+	if (c)
+		client_journal_visit(c, pos, consumed);
 }
 
-void run_server(int port)
+void run_server(int port, const server_opts_t *opts)
 {
 	int one = 1;
 
 	// Setup sockets
-	// UDP socket
-	int udp_fd = socket(AF_INET, SOCK_DGRAM, 0);
-	if (udp_fd < 0) {
-		perror("socket udp");
-		exit(1);
-	}
-
-	if (setsockopt(udp_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one)) < 0) {
-		perror("setsockopt UDP");
-		exit(1);
+	// UDP socket, unless ingest threads open their own
+	int udp_fd = -1;
+	if (!opts->ingest) {
+		udp_fd = udp_open(port, false);
+		if (udp_fd < 0)
+			exit(1);
 	}
 
-	// TCP socket
-	int tcp_fd = socket(AF_INET, SOCK_STREAM, 0);
+	// TCP socket, non-blocking so accepting can drain the backlog
+	int tcp_fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK, 0);
 	if (tcp_fd < 0) {
 		perror("socket tcp");
 		exit(1);
@@ -152,11 +605,6 @@ void run_server(int port)
 		.sin_family = AF_INET,
 		.sin_port = htons(port),
 		.sin_addr.s_addr = INADDR_ANY};
-	if (bind(udp_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-		perror("bind UDP");
-		exit(1);
-	}
-
 	if (bind(tcp_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
 		perror("bind TCP");
 		exit(1);
@@ -167,10 +615,18 @@ void run_server(int port)
 		exit(1);
 	}
 
-	// Client lists: active and inactive (to preserve subscriptions)
-	client_t *clients = NULL;
-	client_t *inactive_clients = NULL;
-	int client_count = 0;
+	// Every client by ID, connected or not (to preserve subscriptions)
+	client_registry_t reg;
+	if (registry_init(&reg) < 0) {
+		perror("registry_init");
+		exit(1);
+	}
+	// Connections that have not sent their ID yet
+	handshake_table_t hs;
+	if (handshakes_init(&hs) < 0) {
+		perror("handshakes_init");
+		exit(1);
+	}
 	int exit_flag = 0;
 
 	// Trie init
@@ -180,129 +636,297 @@ void run_server(int port)
 		exit(1);
 	}
 
-	while (!exit_flag) {
-		// build poll fds
-		int nfds = 3 + client_count;
-		struct pollfd *pfds = malloc(nfds * sizeof(*pfds));
-		if (!pfds) {
-			perror("malloc pfds");
-			break;
-		}
+	// Reactor: the fixed descriptors are registered once here, each
+	// client once on connect, so a wakeup only costs the ready ones
+	int epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (epfd < 0) {
+		perror("epoll_create1");
+		exit(1);
+	}
+	if (reactor_add(epfd, STDIN_FILENO, EPOLLIN, &stdin_tag) < 0 ||
+		(udp_fd >= 0 && reactor_add(epfd, udp_fd, EPOLLIN, &udp_tag) < 0) ||
+		reactor_add(epfd, tcp_fd, EPOLLIN, &tcp_tag) < 0)
+		exit(1);
 
-		// 0 = stdin, 1 = udp, 2 = tcp accept
-		pfds[0] = (struct pollfd){.fd = STDIN_FILENO, .events = POLLIN};
-		pfds[1] = (struct pollfd){.fd = udp_fd, .events = POLLIN};
-		pfds[2] = (struct pollfd){.fd = tcp_fd, .events = POLLIN};
+	struct epoll_event events[MAX_EVENTS];
 
-		int idx = 3;
-		for (client_t *c = clients; c; c = c->next) {
-			pfds[idx++] = (struct pollfd){.fd = c->fd, .events = POLLIN};
-		}
+	client_set_out_limits(opts->out_hwm, opts->out_policy);
+	client_set_store_limits(opts->store_msgs, opts->store_bytes);
+	trie_cache_configure(opts->match_cache);
+	if (opts->workers && workers_start(opts->workers) < 0)
+		exit(1);
 
-		if (poll(pfds, nfds, -1) < 0) {
-			perror("poll");
-			free(pfds);
-			break;
+	// subscriptions from the last run, before the journal names any
+	// client; like new ones, the clients are bound to workers
+	if (opts->snapshot &&
+		snapshot_load(opts->snapshot, root, &reg, client_get) < 0) {
+		fprintf(stderr, "Cannot load snapshot %s\n", opts->snapshot);
+		exit(1);
+	}
+	long next_snapshot = now_ms() + opts->snapshot_every * 1000L;
+	pid_t snapshot_pid = 0;			// background save running, 0 = none
+
+	// the journal's clients are bound to workers like any other
+	journal_t journal;
+	if (opts->journal_dir) {
+		client_set_journal(&journal);
+		if (journal_open(&journal, opts->journal_dir, JOURNAL_SEGMENT_SIZE,
+						 opts->journal_sync, JOURNAL_SYNC_INTERVAL_MS,
+						 journal_recover, &reg) < 0) {
+			fprintf(stderr, "Cannot open journal in %s\n", opts->journal_dir);
+			exit(1);
 		}
+	}
 
-		idx = 0;
-		// — exit on stdin —
-		if (pfds[idx++].revents & POLLIN) {
-			char buf[32];
-			if (fgets(buf, sizeof(buf), stdin) &&
-				strcmp(buf, "exit\n") == 0)
-				exit_flag = 1;
-		}
+	udp_batch_t batch;
+	if (udp_batch_init(&batch, opts->udp_batch) < 0) {
+		perror("udp_batch_init");
+		exit(1);
+	}
 
-		// — incoming UDP? —
-		if (pfds[idx].revents & POLLIN) {
-			char buf[MAX_UDP_PAYLOAD];
-			struct sockaddr_in src;
-			socklen_t slen = sizeof(src);
-			ssize_t n = recvfrom(udp_fd, buf, sizeof(buf), 0,
-								 (struct sockaddr *)&src, &slen);
-			if (n > 0)
-			{
-				char *topic = extract_topic(buf);
-				if (strlen(topic) > MAX_TOPIC_LEN) {
-					perror("Topic too long");
-					exit(1);
-				}
+	// ingest threads publish concurrently: start them last
+	ingest_t *ingests = calloc(opts->ingest, sizeof(*ingests));
+	if (opts->ingest && !ingests) {
+		perror("calloc");
+		exit(1);
+	}
+	for (unsigned int i = 0; i < opts->ingest; i++) {
+		if (ingest_start(&ingests[i], i, port, root, opts->udp_batch) < 0)
+			exit(1);
+	}
 
-				n = build_packet(&src, buf, n);
-				if (n > 0)
-					trie_publish(root, topic, buf, n);
-				free(topic);
+	while (!exit_flag) {
+		int timeout = handshakes_expire(&hs, epfd, tcp_fd);
+		if (opts->snapshot && opts->snapshot_every) {
+			// this thread makes every subscription change, so the
+			// forked child gets a trie that is not mid-change; it
+			// writes and syncs the file while the reactor goes on
+			long now = now_ms();
+			if (snapshot_pid && snapshot_wait(snapshot_pid, false) != 0)
+				snapshot_pid = 0;
+			if (!snapshot_pid && now >= next_snapshot) {
+				snapshot_pid = snapshot_save_bg(opts->snapshot, root, &reg);
+				// no fork: save in place rather than not at all
+				if (snapshot_pid < 0) {
+					snapshot_save(opts->snapshot, root, &reg);
+					snapshot_pid = 0;
+				}
+				now = now_ms();
+				next_snapshot = now + opts->snapshot_every * 1000L;
 			}
+			// while the child runs, wake up now and then to reap it
+			long due = snapshot_pid ? SNAPSHOT_REAP_MS : next_snapshot - now;
+			if (timeout < 0 || due < timeout)
+				timeout = due;
 		}
-		idx++;
-
-		// — new TCP connection? —
-		if (pfds[idx].revents & POLLIN) {
-			handle_new_tcp_connection(tcp_fd,
-									  &clients,
-									  &inactive_clients,
-									  &client_count);
+		// records appended by the last publishes reach the disk within
+		// the sync interval even if nothing is published after them
+		long sync_due = client_store_sync();
+		if (sync_due >= 0 && (timeout < 0 || sync_due < timeout))
+			timeout = sync_due;
+		int nev = epoll_wait(epfd, events, MAX_EVENTS, timeout);
+		if (nev < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait");
+			break;
 		}
-		idx++;
-
-		// — handle TCP client data / disconnect —
-		client_t *prev = NULL, *cur = clients;
-		while (cur) {
-			if (pfds[idx].revents & (POLLIN | POLLHUP | POLLERR)) {
-				if (client_handle_data(root, cur) < 0) {
-					// client disconnected: keep subscriptions
-					// or error in connection
-					printf("Client %s disconnected.\n", cur->id);
-					client_count--;
-
-					client_t *dead = cur;
-					cur = cur->next;
-					if (prev)
-						prev->next = cur;
-					else
-						clients = cur;
-
-					// move to inactive list
-					close(dead->fd);
-					dead->fd = -1;
-					dead->next = inactive_clients;
-					inactive_clients = dead;
-
-					idx++;
-					continue;
+
+		for (int i = 0; i < nev; i++) {
+			void *cookie = events[i].data.ptr;
+			uint32_t revents = events[i].events;
+
+			// — exit on stdin —
+			if (cookie == &stdin_tag) {
+				char buf[32];
+				if (!fgets(buf, sizeof(buf), stdin)) {
+					// EOF: stop watching, or it stays readable forever
+					epoll_ctl(epfd, EPOLL_CTL_DEL, STDIN_FILENO, NULL);
+				} else if (strcmp(buf, "exit\n") == 0) {
+					exit_flag = 1;
+				} else if (strcmp(buf, "stats\n") == 0) {
+					print_stats(&batch, ingests, opts->ingest,
+								opts->journal_dir ? &journal : NULL,
+								&reg);
 				}
+				continue;
+			}
+
+			// — incoming UDP? —
+			if (cookie == &udp_tag) {
+				handle_udp_batch(udp_fd, &batch, root);
+				continue;
+			}
+
+			// — new TCP connection? —
+			if (cookie == &tcp_tag) {
+				handle_new_tcp_connections(epfd, tcp_fd, &hs);
+				continue;
+			}
+
+			// — ID line of a new connection? —
+			if (is_handshake(&hs, cookie)) {
+				handshake_read(&hs, cookie, epfd, tcp_fd, &reg);
+				continue;
+			}
+
+			// — handle TCP client data / writability / disconnect —
+			client_t *cur = cookie;
+			int dead = 0;
+			if ((revents & EPOLLOUT) && client_flush(cur) < 0)
+				dead = 1;
+			else if ((revents & EPOLLOUT) && cur->replaying)
+				client_replay(cur);
+			if (!dead && (revents & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+				dead = client_handle_data(root, cur) < 0;
+			if (dead) {
+				// client disconnected: keep subscriptions
+				// or error in connection
+				printf("Client %s disconnected.\n", cur->id);
+				client_detach(cur);
 			}
-			prev = cur;
-			cur = cur->next;
-			idx++;
 		}
-		free(pfds);
 	}
 
 	// — final cleanup —
-	for (client_t *c = clients; c;) {
-		client_t *tmp = c;
-		c = c->next;
-		client_destroy(root, tmp);
-	}
-	for (client_t *c = inactive_clients; c;) {
-		client_t *tmp = c;
-		c = c->next;
-		client_destroy(root, tmp);
+	for (unsigned int i = 0; i < opts->ingest; i++)
+		ingest_stop(&ingests[i]);
+	free(ingests);
+	// the last snapshot is written in place, after any background one
+	// (both go through the same temporary file)
+	if (snapshot_pid)
+		snapshot_wait(snapshot_pid, true);
+	if (opts->snapshot)
+		snapshot_save(opts->snapshot, root, &reg);
+
+	// sockets are closed by their workers, which are let drain first
+	for (unsigned int i = 0; i < reg.cap; i++)
+		if (reg.slots[i])
+			client_detach(reg.slots[i]);
+	if (opts->workers)
+		workers_stop();
+	registry_destroy(&reg, root);
+	if (opts->journal_dir) {
+		client_set_journal(NULL);
+		journal_close(&journal);
 	}
+	while (hs.head)
+		handshake_end(&hs, hs.head, epfd, tcp_fd, true);
+	free(hs.slots);
+	udp_batch_free(&batch);
+	close(epfd);
 	close(tcp_fd);
-	close(udp_fd);
+	if (udp_fd >= 0)
+		close(udp_fd);
+}
+
+void usage(const char *prog)
+{
+	fprintf(stderr,
+			"Usage: %s [-b udp_batch] [-q queue_bytes] "
+			"[-p drop-oldest|drop-newest|disconnect] [-c cache_bytes] "
+			"[-w workers] [-r udp_reactors] [-s store_msgs] "
+			"[-S store_bytes] [-j journal_dir] "
+			"[-y none|batch|interval] [-f snapshot_file] "
+			"[-i snapshot_seconds] <port>\n",
+			prog);
+	exit(1);
 }
 
 int main(int argc, char **argv)
 {
 	setvbuf(stdout, NULL, _IONBF, BUFSIZ);
 
-	if (argc != 2) {
-		fprintf(stderr, "Usage: %s <port>\n", argv[0]);
-		return 1;
+	server_opts_t opts = {
+		.udp_batch = DEFAULT_UDP_BATCH,
+		.out_hwm = DEFAULT_OUT_HWM,
+		.out_policy = OUT_DROP_OLDEST,
+		.match_cache = DEFAULT_MATCH_CACHE_BYTES,
+		.store_msgs = DEFAULT_STORE_MSGS,
+		.store_bytes = DEFAULT_STORE_BYTES,
+		.journal_sync = JOURNAL_SYNC_INTERVAL,
+		.snapshot_every = DEFAULT_SNAPSHOT_INTERVAL};
+	int opt;
+	while ((opt = getopt(argc, argv, "b:q:p:c:w:r:s:S:j:y:f:i:")) != -1) {
+		switch (opt) {
+		case 'b':
+			opts.udp_batch = atoi(optarg);
+			if (opts.udp_batch < 1 || opts.udp_batch > MAX_UDP_BATCH) {
+				fprintf(stderr, "UDP batch must be in [1, %d]\n",
+						MAX_UDP_BATCH);
+				return 1;
+			}
+			break;
+		case 'q':
+			opts.out_hwm = strtoul(optarg, NULL, 10);
+			if (opts.out_hwm == 0) {
+				fprintf(stderr, "Queue limit must be positive\n");
+				return 1;
+			}
+			break;
+		case 'p':
+			if (strcmp(optarg, "drop-oldest") == 0)
+				opts.out_policy = OUT_DROP_OLDEST;
+			else if (strcmp(optarg, "drop-newest") == 0)
+				opts.out_policy = OUT_DROP_NEWEST;
+			else if (strcmp(optarg, "disconnect") == 0)
+				opts.out_policy = OUT_DISCONNECT;
+			else
+				usage(argv[0]);
+			break;
+		case 'c':
+			opts.match_cache = strtoul(optarg, NULL, 10);
+			break;
+		case 'w':
+			opts.workers = atoi(optarg);
+			if (opts.workers > MAX_WORKERS) {
+				fprintf(stderr, "Workers must be in [0, %d]\n", MAX_WORKERS);
+				return 1;
+			}
+			break;
+		case 'r':
+			opts.ingest = atoi(optarg);
+			if (opts.ingest > MAX_INGEST) {
+				fprintf(stderr, "UDP reactors must be in [0, %d]\n",
+						MAX_INGEST);
+				return 1;
+			}
+			break;
+		case 's':
+			opts.store_msgs = strtoul(optarg, NULL, 10);
+			break;
+		case 'S':
+			opts.store_bytes = strtoul(optarg, NULL, 10);
+			break;
+		case 'j':
+			opts.journal_dir = optarg;
+			break;
+		case 'y':
+			if (strcmp(optarg, "none") == 0)
+				opts.journal_sync = JOURNAL_SYNC_NONE;
+			else if (strcmp(optarg, "batch") == 0)
+				opts.journal_sync = JOURNAL_SYNC_BATCH;
+			else if (strcmp(optarg, "interval") == 0)
+				opts.journal_sync = JOURNAL_SYNC_INTERVAL;
+			else
+				usage(argv[0]);
+			break;
+		case 'f':
+			opts.snapshot = optarg;
+			break;
+		case 'i':
+			opts.snapshot_every = strtoul(optarg, NULL, 10);
+			break;
+		default:
+			usage(argv[0]);
+		}
 	}
-	run_server(atoi(argv[1]));
+
+	if (argc - optind != 1)
+		usage(argv[0]);
+	// concurrent publishers may only reach sockets through workers
+	if (opts.ingest && !opts.workers)
+		opts.workers = opts.ingest < MAX_WORKERS ? opts.ingest : MAX_WORKERS;
+	run_server(atoi(argv[optind]), &opts);
 	return 0;
 }
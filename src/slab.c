@@ -0,0 +1,136 @@
+// 324CC Stefan CALMAC
+#include "../include/slab.h"
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+// a chunk of SLAB_OBJS objects, chained for the occupancy report
+struct slab {
+	struct slab *next;
+	max_align_t objs[];
+};
+
+static unsigned long heap_allocs;
+
+// carve a fresh slab into the pool's free list
+int slab_grow(slab_pool_t *p)
+{
+	if (p->obj_size < sizeof(void *))
+		p->obj_size = sizeof(void *);
+	p->obj_size = (p->obj_size + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+
+	struct slab *s = malloc(sizeof(*s) + SLAB_OBJS * p->obj_size);
+	if (!s)
+		return -1;
+	heap_allocs++;
+	s->next = p->slabs;
+	p->slabs = s;
+	p->nslabs++;
+	p->capacity += SLAB_OBJS;
+
+	char *base = (char *)s->objs;
+	for (int i = SLAB_OBJS - 1; i >= 0; i--) {
+		void *obj = base + i * p->obj_size;
+		*(void **)obj = p->free_list;
+		p->free_list = obj;
+	}
+	return 0;
+}
+
+void *slab_alloc(slab_pool_t *p)
+{
+	if (!p->free_list && slab_grow(p) < 0)
+		return NULL;
+
+	void *obj = p->free_list;
+	p->free_list = *(void **)obj;
+	p->in_use++;
+	return obj;
+}
+
+void *slab_zalloc(slab_pool_t *p)
+{
+	void *obj = slab_alloc(p);
+	if (obj)
+		memset(obj, 0, p->obj_size);
+	return obj;
+}
+
+void slab_free(slab_pool_t *p, void *obj)
+{
+	if (!obj)
+		return;
+	*(void **)obj = p->free_list;
+	p->free_list = obj;
+	p->in_use--;
+}
+
+void slab_print_stats(const slab_pool_t *p, FILE *out)
+{
+	fprintf(out,
+			"pool %-10s %4zu B x %lu/%lu in use (%lu slabs, %lu KiB)\n",
+			p->name, p->obj_size, p->in_use, p->capacity, p->nslabs,
+			(unsigned long)(p->capacity * p->obj_size) / 1024);
+}
+
+// — size-class arena —
+
+#define ARENA_CLASSES 4
+#define ARENA_MIN_SHIFT 4		// smallest class: 16 bytes
+
+static slab_pool_t arena_pools[ARENA_CLASSES] = {
+	SLAB_POOL_INIT("arena16", 16),
+	SLAB_POOL_INIT("arena32", 32),
+	SLAB_POOL_INIT("arena64", 64),
+	SLAB_POOL_INIT("arena128", 128),
+};
+static unsigned long arena_big;
+
+// size class for a `size`-byte block, -1 if too big
+int arena_class(size_t size)
+{
+	for (int c = 0; c < ARENA_CLASSES; c++)
+		if (size <= ((size_t)1 << (ARENA_MIN_SHIFT + c)))
+			return c;
+	return -1;
+}
+
+void *arena_alloc(size_t size)
+{
+	int c = arena_class(size);
+	if (c >= 0)
+		return slab_alloc(&arena_pools[c]);
+
+	void *p = malloc(size);
+	if (p) {
+		heap_allocs++;
+		arena_big++;
+	}
+	return p;
+}
+
+void arena_free(void *p, size_t size)
+{
+	if (!p)
+		return;
+	int c = arena_class(size);
+	if (c >= 0) {
+		slab_free(&arena_pools[c], p);
+	} else {
+		free(p);
+		arena_big--;
+	}
+}
+
+void arena_print_stats(FILE *out)
+{
+	for (int c = 0; c < ARENA_CLASSES; c++)
+		slab_print_stats(&arena_pools[c], out);
+	fprintf(out, "pool arenabig   %lu on the heap\n", arena_big);
+}
+
+unsigned long slab_heap_allocs(void)
+{
+	return heap_allocs;
+}
@@ -0,0 +1,466 @@
+// 324CC Stefan CALMAC
+#define _GNU_SOURCE // close_range
+#include "../include/snapshot.h"
+#include "../include/clock.h"
+#include "../include/intern.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#define SNAP_MAGIC "PSSNAP2\n"
+#define SNAP_NO_PARENT UINT32_MAX
+#define SNAP_WRITE_BUF (1 << 20)
+
+// File layout: the header, then
+//   clients  nclients NUL-padded IDs
+//   nodes    nnodes snap_node_t, pre-order: a parent comes before its
+//            children and node 0 is the root
+//   subs     nsubs (client index << 2 | filtered << 1 | sf), node by
+//            node
+//   filters  a snap_filter_t for each filtered sub, in the same order
+//   names    names_len bytes, the named nodes' segments back to back
+typedef struct snap_header {
+	char magic[8];
+	uint32_t nclients;
+	uint32_t nnodes;
+	uint64_t nsubs;
+	uint64_t names_len;
+	uint64_t size;			// whole file, to catch truncation
+} snap_header_t;
+
+typedef struct snap_node {
+	uint32_t parent;		// node index, SNAP_NO_PARENT for the root
+	uint32_t ptype;			// child_type_t
+	uint32_t name_len;		// CHILD_NAME only
+	uint32_t nnamed;		// named children, to size the child table
+	uint32_t nsubs;
+} snap_node_t;
+
+// value_filter_t, field by field; read with memcpy (unaligned)
+typedef struct snap_filter {
+	uint32_t type;
+	uint32_t op;
+	double value;
+} snap_filter_t;
+
+// client_t * -> index in the clients section, open addressing
+typedef struct snap_index {
+	const client_t **keys;
+	uint32_t *vals;
+	size_t cap;				// power of two
+} snap_index_t;
+
+// what a trie walk writes
+typedef enum {
+	SNAP_NODES,
+	SNAP_SUBS,
+	SNAP_FILTERS,
+	SNAP_NAMES
+} snap_pass_t;
+
+typedef struct snap_writer {
+	FILE *f;
+	snap_index_t index;
+	snap_header_t hdr;
+	uint32_t next;			// index of the next node walked
+} snap_writer_t;
+
+static inline size_t snap_hash(const client_t *c)
+{
+	return ((uintptr_t)c * 0x9E3779B97F4A7C15ull) >> 32;
+}
+
+static int index_init(snap_index_t *x, unsigned int count)
+{
+	x->cap = 16;
+	while (x->cap < (size_t)count * 2)
+		x->cap *= 2;
+	x->keys = calloc(x->cap, sizeof(*x->keys));
+	x->vals = malloc(x->cap * sizeof(*x->vals));
+	return x->keys && x->vals ? 0 : -1;
+}
+
+static void index_put(snap_index_t *x, const client_t *c, uint32_t v)
+{
+	size_t i = snap_hash(c) & (x->cap - 1);
+	while (x->keys[i])
+		i = (i + 1) & (x->cap - 1);
+	x->keys[i] = c;
+	x->vals[i] = v;
+}
+
+// UINT32_MAX if c is not registered
+static uint32_t index_get(const snap_index_t *x, const client_t *c)
+{
+	for (size_t i = snap_hash(c) & (x->cap - 1); x->keys[i];
+		 i = (i + 1) & (x->cap - 1))
+		if (x->keys[i] == c)
+			return x->vals[i];
+	return UINT32_MAX;
+}
+
+static unsigned int count_subscribers(const topic_node_t *n)
+{
+	unsigned int k = 0;
+	for (const client_list_t *e = n->subscribers; e; e = e->next)
+		k++;
+	return k;
+}
+
+// write n's part of one section, then its children's, in the same
+// pre-order on every pass. Returns -1 on a write error or a
+// subscriber missing from the registry
+int snap_walk(snap_writer_t *w, snap_pass_t pass, const topic_node_t *n,
+			  uint32_t parent)
+{
+	uint32_t self = w->next++;
+
+	if (pass == SNAP_NODES) {
+		snap_node_t rec = {
+			.parent = parent,
+			.ptype = n->ptype,
+			.name_len = n->pname ? n->pname->len : 0,
+			.nnamed = n->nchildren,
+			.nsubs = count_subscribers(n)};
+		if (fwrite(&rec, sizeof(rec), 1, w->f) != 1)
+			return -1;
+		w->hdr.nsubs += rec.nsubs;
+		w->hdr.names_len += rec.name_len;
+	} else if (pass == SNAP_SUBS) {
+		for (const client_list_t *e = n->subscribers; e; e = e->next) {
+			uint32_t idx = index_get(&w->index, e->cl);
+			if (idx == UINT32_MAX) {
+				fprintf(stderr, "snapshot: subscriber not registered\n");
+				return -1;
+			}
+			uint32_t v = idx << 2 | e->filtered << 1 | e->sf;
+			if (fwrite(&v, sizeof(v), 1, w->f) != 1)
+				return -1;
+		}
+	} else if (pass == SNAP_FILTERS) {
+		for (const client_list_t *e = n->subscribers; e; e = e->next) {
+			if (!e->filtered)
+				continue;
+			snap_filter_t rec = {
+				.type = e->filter.type,
+				.op = e->filter.op,
+				.value = e->filter.value};
+			if (fwrite(&rec, sizeof(rec), 1, w->f) != 1)
+				return -1;
+		}
+	} else if (n->pname &&
+			   fwrite(n->pname->str, 1, n->pname->len, w->f) != n->pname->len) {
+		return -1;
+	}
+
+	const struct child *kids = n->table ? n->table : n->small;
+	unsigned int nkids = n->table ? n->child_cap : n->nchildren;
+	for (unsigned int i = 0; i < nkids; i++)
+		if (kids[i].node && snap_walk(w, pass, kids[i].node, self) < 0)
+			return -1;
+	if (n->plus_child && snap_walk(w, pass, n->plus_child, self) < 0)
+		return -1;
+	if (n->star_child && snap_walk(w, pass, n->star_child, self) < 0)
+		return -1;
+	return 0;
+}
+
+// everything but the final rename; the header is patched in last
+int snap_write(snap_writer_t *w, const topic_node_t *root,
+			   const client_registry_t *reg)
+{
+	if (fwrite(&w->hdr, sizeof(w->hdr), 1, w->f) != 1)
+		return -1;
+
+	for (unsigned int i = 0; i < reg->cap; i++) {
+		const client_t *c = reg->slots[i];
+		if (!c)
+			continue;
+		char id[sizeof(c->id)] = {0};
+		memcpy(id, c->id, strnlen(c->id, sizeof(id) - 1));
+		if (fwrite(id, sizeof(id), 1, w->f) != 1)
+			return -1;
+		index_put(&w->index, c, w->hdr.nclients++);
+	}
+
+	for (snap_pass_t pass = SNAP_NODES; pass <= SNAP_NAMES; pass++) {
+		w->next = 0;
+		if (snap_walk(w, pass, root, SNAP_NO_PARENT) < 0)
+			return -1;
+		if (pass == SNAP_NODES)
+			w->hdr.nnodes = w->next;
+	}
+
+	long size = ftell(w->f);
+	if (size < 0)
+		return -1;
+	w->hdr.size = size;
+	if (fseek(w->f, 0, SEEK_SET) < 0 ||
+		fwrite(&w->hdr, sizeof(w->hdr), 1, w->f) != 1 ||
+		fflush(w->f) != 0 || fsync(fileno(w->f)) < 0)
+		return -1;
+	return 0;
+}
+
+int snapshot_save(const char *path, topic_node_t *root,
+				  const client_registry_t *reg)
+{
+	char tmp[4096];
+	if (snprintf(tmp, sizeof(tmp), "%s.tmp", path) >= (int)sizeof(tmp)) {
+		fprintf(stderr, "snapshot: path too long\n");
+		return -1;
+	}
+
+	snap_writer_t w = {0};
+	memcpy(w.hdr.magic, SNAP_MAGIC, sizeof(w.hdr.magic));
+	w.f = fopen(tmp, "wb");
+	if (!w.f) {
+		perror("fopen snapshot");
+		return -1;
+	}
+	setvbuf(w.f, NULL, _IOFBF, SNAP_WRITE_BUF);
+
+	int ret = index_init(&w.index, reg->count);
+	if (ret == 0)
+		ret = snap_write(&w, root, reg);
+	if (ret < 0)
+		perror("write snapshot");
+	if (fclose(w.f) != 0 && ret == 0) {
+		perror("close snapshot");
+		ret = -1;
+	}
+	free(w.index.keys);
+	free(w.index.vals);
+
+	if (ret == 0 && rename(tmp, path) < 0) {
+		perror("rename snapshot");
+		ret = -1;
+	}
+	if (ret < 0)
+		unlink(tmp);
+	return ret;
+}
+
+pid_t snapshot_save_bg(const char *path, topic_node_t *root,
+					   const client_registry_t *reg)
+{
+	pid_t pid = fork();
+	if (pid < 0) {
+		perror("fork snapshot");
+		return -1;
+	}
+	if (pid > 0)
+		return pid;
+	// the child: its copy-on-write image of the trie stays as it was at
+	// the fork. Sockets are let go so a peer the parent closes sees it,
+	// and _exit skips the parent's atexit handlers and stdio buffers
+	close_range(3, ~0U, 0);
+	_exit(snapshot_save(path, root, reg) < 0);
+}
+
+int snapshot_wait(pid_t pid, bool block)
+{
+	int status;
+	pid_t r = waitpid(pid, &status, block ? 0 : WNOHANG);
+	if (r == 0)
+		return 0;
+	if (r < 0) {
+		perror("waitpid snapshot");
+		return -1;
+	}
+	if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "snapshot: background save failed\n");
+		return -1;
+	}
+	return 1;
+}
+
+// the sections of a mapped snapshot, once snap_check found them sound
+typedef struct snap_view {
+	const snap_header_t *hdr;
+	const char (*ids)[16];
+	const snap_node_t *nodes;
+	const uint32_t *subs;
+	const char *filters;	// snap_filter_t records, maybe unaligned
+	const char *names;
+} snap_view_t;
+
+// validate every count, index and length against the file before
+// anything is built from it
+int snap_check(const char *map, size_t size, snap_view_t *v)
+{
+	const snap_header_t *h = (const snap_header_t *)map;
+	if (size < sizeof(*h) || h->size != size || h->nnodes == 0)
+		return -1;
+	if (memcmp(h->magic, SNAP_MAGIC, 8) != 0)
+		return -1;
+
+	// 64-bit sums of 32-bit counts cannot overflow; the names and
+	// subs counts are bounded by the file size first
+	if (h->nsubs > size || h->names_len > size)
+		return -1;
+	uint64_t need = sizeof(*h) + (uint64_t)h->nclients * 16 +
+					(uint64_t)h->nnodes * sizeof(snap_node_t) +
+					h->nsubs * sizeof(uint32_t) + h->names_len;
+	if (need > size)
+		return -1;
+
+	v->hdr = h;
+	v->ids = (const char (*)[16])(h + 1);
+	v->nodes = (const snap_node_t *)(v->ids + h->nclients);
+	v->subs = (const uint32_t *)(v->nodes + h->nnodes);
+	v->filters = (const char *)(v->subs + h->nsubs);
+
+	// the filters section is sized by the subs' filtered bits
+	uint64_t nfilters = 0;
+	for (uint64_t i = 0; i < h->nsubs; i++) {
+		if ((v->subs[i] >> 2) >= h->nclients)
+			return -1;
+		nfilters += (v->subs[i] >> 1) & 1;
+	}
+	if (need + nfilters * sizeof(snap_filter_t) != size)
+		return -1;
+	v->names = v->filters + nfilters * sizeof(snap_filter_t);
+
+	for (uint64_t i = 0; i < nfilters; i++) {
+		snap_filter_t f;
+		memcpy(&f, v->filters + i * sizeof(f), sizeof(f));
+		if (f.type > PAYLOAD_FLOAT || f.op > FILTER_NE || !isfinite(f.value))
+			return -1;
+	}
+
+	for (uint32_t i = 0; i < h->nclients; i++)
+		if (!v->ids[i][0] || !memchr(v->ids[i], '\0', 16))
+			return -1;
+
+	uint64_t nsubs = 0, names_len = 0;
+	for (uint32_t i = 0; i < h->nnodes; i++) {
+		const snap_node_t *r = &v->nodes[i];
+		bool bad_link = i == 0
+			? r->parent != SNAP_NO_PARENT || r->name_len > 0
+			: r->parent >= i ||
+			  (r->ptype == CHILD_NAME) != (r->name_len > 0);
+		if (bad_link || r->ptype > CHILD_STAR || r->nnamed >= h->nnodes)
+			return -1;
+		nsubs += r->nsubs;
+		names_len += r->name_len;
+	}
+	if (nsubs != h->nsubs || names_len != h->names_len)
+		return -1;
+	return 0;
+}
+
+// rebuild from a checked view; only allocations can fail
+int snap_build(const snap_view_t *v, topic_node_t *root,
+			   client_registry_t *reg, snapshot_client_fn get)
+{
+	const snap_header_t *h = v->hdr;
+	client_t **clients = malloc(((size_t)h->nclients + 1) * sizeof(*clients));
+	topic_node_t **nodes = malloc((size_t)h->nnodes * sizeof(*nodes));
+	int ret = -1;
+	if (!clients || !nodes ||
+		registry_reserve(reg, reg->count + h->nclients) < 0)
+		goto out;
+
+	for (uint32_t i = 0; i < h->nclients; i++) {
+		clients[i] = get(reg, v->ids[i]);
+		if (!clients[i])
+			goto out;
+	}
+
+	const uint32_t *sub = v->subs;
+	const char *filter = v->filters;
+	const char *name = v->names;
+	for (uint32_t i = 0; i < h->nnodes; i++) {
+		const snap_node_t *r = &v->nodes[i];
+		topic_node_t *n = root;
+		if (i > 0) {
+			seg_span_t sp = {.len = r->name_len};
+			if (r->ptype == CHILD_NAME)
+				sp.hash = seg_hash(name, r->name_len);
+			n = node_child(nodes[r->parent], r->ptype, name, &sp);
+			name += r->name_len;
+		}
+		if (!n || node_reserve_children(n, r->nnamed) < 0)
+			goto out;
+		nodes[i] = n;
+
+		// subscribers are prepended: add them back to front to keep
+		// the saved order, their filters too
+		uint32_t nf = 0;
+		for (uint32_t k = 0; k < r->nsubs; k++)
+			nf += (sub[k] >> 1) & 1;
+		filter += nf * sizeof(snap_filter_t);
+		const char *fk = filter;
+		for (uint32_t k = r->nsubs; k-- > 0;) {
+			value_filter_t f;
+			bool filtered = sub[k] & 2;
+			if (filtered) {
+				snap_filter_t rec;
+				fk -= sizeof(rec);
+				memcpy(&rec, fk, sizeof(rec));
+				f = (value_filter_t){
+					.type = rec.type, .op = rec.op, .value = rec.value};
+			}
+			if (node_add_subscriber(n, clients[sub[k] >> 2],
+									sub[k] & 1, filtered ? &f : NULL) < 0)
+				goto out;
+		}
+		sub += r->nsubs;
+	}
+	ret = 0;
+
+out:
+	free(clients);
+	free(nodes);
+	return ret;
+}
+
+int snapshot_load(const char *path, topic_node_t *root,
+				  client_registry_t *reg, snapshot_client_fn get)
+{
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		if (errno == ENOENT)
+			return 0;
+		perror("open snapshot");
+		return -1;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) < 0 || st.st_size == 0) {
+		fprintf(stderr, "snapshot %s: empty or unreadable\n", path);
+		close(fd);
+		return -1;
+	}
+	long t0 = now_ms();
+	char *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		perror("mmap snapshot");
+		return -1;
+	}
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	snap_view_t v;
+	int ret = snap_check(map, st.st_size, &v);
+	if (ret < 0)
+		fprintf(stderr, "snapshot %s: corrupt\n", path);
+	else if ((ret = snap_build(&v, root, reg, get)) < 0)
+		fprintf(stderr, "snapshot %s: out of memory while loading\n", path);
+	else
+		fprintf(stderr,
+				"snapshot: %u clients, %u nodes, %lu subscriptions "
+				"loaded in %ld ms\n",
+				v.hdr->nclients, v.hdr->nnodes,
+				(unsigned long)v.hdr->nsubs, now_ms() - t0);
+	munmap(map, st.st_size);
+	return ret < 0 ? -1 : 1;
+}
@@ -1,209 +1,190 @@
 // 324CC Stefan CALMAC
+#include "../include/payload.h"
 #include "../include/protocol.h"
 
 #define SUB_LEN 10
 #define UNSUB_LEN 12
-#define READ_BUF_SIZE 2048
-
-// recv_all: read exactly `len` bytes from `sockfd` into `buf`
-// returns number of bytes read (== len), 0 on orderly shutdown, or -1 on error
-ssize_t recv_all(int sockfd, void *buf, size_t len)
-{
-	size_t total = 0;
-	char *p = buf;
-	while (total < len) {
-		ssize_t r = recv(sockfd, p + total, len - total, 0);
-		if (r < 0)
-			return -1; // error
-		if (r == 0)
-			return 0; // peer closed
-		total += r;
-	}
-	return total;
-}
-
-void process_payload(char *payload, size_t len)
+// a publish carrying a full-size datagram is the biggest message
+#define READ_BUF_SIZE MAX_PUBLISH_LEN
+// what one recv() may take in: many small messages, or a whole big one
+#define RX_BUF_SIZE (1 << 18)
+// stdout buffer, flushed after each batch of messages
+#define OUT_BUF_SIZE (1 << 16)
+// one rendered publish: "IP:port - topic - " and the formatted value
+#define LINE_BUF_SIZE (INET_ADDRSTRLEN + 9 + MAX_TOPIC_LEN + \
+					   READ_BUF_SIZE + PAYLOAD_TEXT_ROOM)
+
+// bytes received from the server, not parsed yet
+typedef struct {
+	char data[RX_BUF_SIZE];
+	size_t len;
+} rx_buf_t;
+
+static char line[LINE_BUF_SIZE];
+
+// emit_line: format the value after the line's prefix, write it out
+void emit_line(char *o, const char *payload, size_t len)
 {
-	if (len < 1) {
-		fprintf(stderr, "Empty payload\n");
+	const char *err;
+	int n = payload_format(o, payload, len, &err);
+	if (n < 0) {
+		fprintf(stderr, "%s\n", err);
 		return;
 	}
-	uint8_t type = payload[0];
-	const char *p = payload + 1;
-	size_t remain = len - 1;
-
-	switch (type)
-	{
-	case 0:
-	{ // INT
-		if (remain < 5) {
-			fprintf(stderr, "Payload too short for INT\n");
-			return;
-		}
-		uint8_t sign = p[0];
-		uint32_t netv;
-		memcpy(&netv, p + 1, 4);
-		uint32_t v = ntohl(netv);
-		if (sign)
-			v = -v;
-		printf("INT - %d\n", v);
-		break;
-	}
-	case 1:
-	{ // SHORT_REAL
-		if (remain < 2) {
-			fprintf(stderr, "Payload too short for SHORT_REAL\n");
-			return;
-		}
-		uint16_t netsh;
-		memcpy(&netsh, p, 2);
-		printf("SHORT_REAL - %.2f\n", ntohs(netsh) / 100.0);
-		break;
-	}
-	case 2:
-	{ // FLOAT
-		if (remain < 6) {
-			fprintf(stderr, "Payload too short for FLOAT\n");
-			return;
-		}
-		uint8_t sign = p[0];
-		uint32_t netm;
-		memcpy(&netm, p + 1, 4);
-		uint8_t exp = p[5];
-		double val = (double)ntohl(netm);
-		for (int i = 0; i < exp; i++)
-			val /= 10.0;
-		if (sign)
-			val = -val;
-		printf("FLOAT - %.*f\n", exp, val);
-		break;
-	}
-	case 3:
-	{ // STRING
-		size_t sl = strnlen((const char *)p, remain);
-		char *s = malloc(sl + 1);
-		memcpy(s, p, sl);
-		s[sl] = '\0';
-		printf("STRING - %s\n", s);
-		free(s);
-		break;
-	}
-	default:
-		fprintf(stderr, "Unknown payload type: %u\n", type);
-	}
+	fwrite(line, 1, o + n - line, stdout);
 }
 
 // print_packet: parse and display a published message buffer
-void print_packet(char *buf, size_t total_len)
+void print_packet(const char *buf, size_t total_len)
 {
-	char *p = buf, *end = buf + total_len;
+	const char *p = buf, *end = buf + total_len;
+	char *o = line;
 
-	// 1) Extract IP (ASCII up to first space)
-	char ip[INET_ADDRSTRLEN] = {0};
-	char *sp = memchr(p, ' ', end - p);
-	if (!sp)
+	// 1) IP and port, ASCII up to a space each
+	const char *sp = memchr(p, ' ', end - p);
+	if (!sp || sp - p >= INET_ADDRSTRLEN)
 		return;
-	size_t ip_len = sp - p;
-	memcpy(ip, p, ip_len);
-	ip[ip_len] = '\0';
-
-	// advance p to start of port
+	memcpy(o, p, sp - p);
+	o += sp - p;
+	*o++ = ':';
 	p = sp + 1;
 
-	// 2) Extract port (ASCII up to next space)
-	char port[6] = {0};
 	sp = memchr(p, ' ', end - p);
-	if (!sp)
+	if (!sp || sp - p > 5)
 		return;
-	size_t port_len = sp - p;
-	memcpy(port, p, port_len);
-	port[port_len] = '\0';
-
-	// advance p to start of topic
+	memcpy(o, p, sp - p);
+	o += sp - p;
 	p = sp + 1;
 
-	// 3) Extract topic (fixed MAX_TOPIC_LEN bytes, not NUL-terminated)
-	if (p + MAX_TOPIC_LEN > end)
+	// 2) topic: fixed MAX_TOPIC_LEN bytes, NUL-padded
+	if (p + MAX_TOPIC_LEN >= end)
 		return;
-	char topic[MAX_TOPIC_LEN + 1];
-	memcpy(topic, p, MAX_TOPIC_LEN);
-	topic[MAX_TOPIC_LEN] = '\0';
-	// taie tot de la primul '\0' adevărat
-	topic[strnlen(topic, MAX_TOPIC_LEN)] = '\0';
-
-	// advance p to data_type byte
+	memcpy(o, " - ", 3);
+	o += 3;
+	size_t tlen = strnlen(p, MAX_TOPIC_LEN);
+	memcpy(o, p, tlen);
+	o += tlen;
+	memcpy(o, " - ", 3);
+	o += 3;
+
+	// 3) the rest is the typed value
 	p += MAX_TOPIC_LEN;
+	emit_line(o, p, end - p);
+}
 
-	// 4) Remaining bytes are the actual payload
-	size_t payload_len = end - p;
-
-	if (payload_len < 1)
+// print_binary_packet: display a MSG_PUBLISH_BIN payload (address,
+// port, topic length, topic, then the typed value)
+void print_binary_packet(const char *buf, size_t total_len)
+{
+	if (total_len < PUB_BIN_HEADER)
+		return;
+	struct in_addr addr;
+	uint16_t port;
+	memcpy(&addr.s_addr, buf, 4);
+	memcpy(&port, buf + 4, 2);
+	size_t tlen = (uint8_t)buf[6];
+	if (PUB_BIN_HEADER + tlen >= total_len)
 		return;
 
-	// 5) Print prefix: "IP:port - topic - "
-	printf("%s:%s - %s - ", ip, port, topic);
-
-	// 6) Decode and print the payload
-	process_payload(p, payload_len);
+	char *o = line;
+	inet_ntop(AF_INET, &addr, o, INET_ADDRSTRLEN);
+	o += strlen(o);
+	*o++ = ':';
+	o = fmt_u32(o, ntohs(port));
+	memcpy(o, " - ", 3);
+	o += 3;
+	memcpy(o, buf + PUB_BIN_HEADER, tlen);
+	o += tlen;
+	memcpy(o, " - ", 3);
+	o += 3;
+
+	emit_line(o, buf + PUB_BIN_HEADER + tlen,
+			  total_len - PUB_BIN_HEADER - tlen);
 }
 
-// handle_received_data: read a full message (header + payload) and dispatch
-int handle_received_data(int sockfd)
+// dispatch_message: display one message from the server
+void dispatch_message(uint16_t type, char *payload, uint32_t length)
 {
-	MsgHeader hdr;
-	ssize_t r = recv_all(sockfd, &hdr, sizeof hdr);
-	if (r <= 0)
-		return (r == 0 ? 0 : -1);
-
-	uint16_t type = ntohs(hdr.type);
-	uint32_t length = ntohl(hdr.length);
-
-	// guard against overly large payloads
-	if (length > READ_BUF_SIZE) {
-		fprintf(stderr, "Payload too large: %u bytes\n", length);
-		return -1;
-	}
-
-	char buf[READ_BUF_SIZE];
-	if (recv_all(sockfd, buf, length) != (ssize_t)length) {
-		fprintf(stderr, "Short read: got less than %u bytes\n", length);
-		return -1;
-	}
-
 	switch (type) {
 	case MSG_PUBLISH:
-		print_packet(buf, length);
+		print_packet(payload, length);
+		break;
+	case MSG_PUBLISH_BIN:
+		print_binary_packet(payload, length);
 		break;
 	case MSG_SUBSCRIBE_ACK:
-		buf[length] = '\0';
-		printf("Subscribed to topic %s\n", buf);
+		printf("Subscribed to topic %.*s\n", (int)length, payload);
 		break;
 	case MSG_UNSUBSCRIBE_ACK:
-		buf[length] = '\0';
-		printf("Unsubscribed from topic %s\n", buf);
+		printf("Unsubscribed from topic %.*s\n", (int)length, payload);
 		break;
 	default:
-		buf[length] = '\0';
-		printf(">> MSG_TYPE %u: %s\n", type, buf);
+		printf(">> MSG_TYPE %u: %.*s\n", type, (int)length, payload);
+	}
+}
+
+// handle_received_data: one recv() into rx, then dispatch every complete
+// message (header + payload) in it and keep the incomplete tail
+int handle_received_data(int sockfd, rx_buf_t *rx)
+{
+	ssize_t r = recv(sockfd, rx->data + rx->len, RX_BUF_SIZE - rx->len, 0);
+	if (r < 0)
+		return errno == EINTR ? 1 : -1;
+	if (r == 0)
+		return 0;
+	rx->len += r;
+
+	size_t off = 0;
+	while (rx->len - off >= sizeof(MsgHeader)) {
+		MsgHeader hdr;
+		memcpy(&hdr, rx->data + off, sizeof(hdr));
+		uint16_t type = ntohs(hdr.type);
+		uint32_t length = ntohl(hdr.length);
+
+		// guard against overly large payloads
+		if (length > READ_BUF_SIZE) {
+			fprintf(stderr, "Payload too large: %u bytes\n", length);
+			return -1;
+		}
+		if (rx->len - off < sizeof(hdr) + length)
+			break;
+
+		dispatch_message(type, rx->data + off + sizeof(hdr), length);
+		off += sizeof(hdr) + length;
 	}
+
+	// compact leftovers
+	memmove(rx->data, rx->data + off, rx->len - off);
+	rx->len -= off;
 	return 1;
 }
 
 int main(int argc, char *argv[])
 {
-	setvbuf(stdout, NULL, _IONBF, 0);
-
-	if (argc != 4) {
+	// binary publishes unless -t asks for the text ones; output is
+	// flushed once per batch of messages unless -l asks for every line
+	bool binary = true, line_flush = false;
+	int opt;
+	while ((opt = getopt(argc, argv, "tl")) != -1) {
+		if (opt == 't')
+			binary = false;
+		else if (opt == 'l')
+			line_flush = true;
+		else
+			break;
+	}
+	if (opt == '?' || argc - optind != 3) {
 		fprintf(stderr,
-				"Usage: %s <ID_CLIENT> <IP_SERVER> <PORT_SERVER>\n",
+				"Usage: %s [-t] [-l] <ID_CLIENT> <IP_SERVER> <PORT_SERVER>\n",
 				argv[0]);
 		exit(EXIT_FAILURE);
 	}
-	const char *client_id = argv[1];
-	const char *server_ip = argv[2];
-	int server_port = atoi(argv[3]);
+	setvbuf(stdout, NULL, line_flush ? _IOLBF : _IOFBF, OUT_BUF_SIZE);
+	const char *client_id = argv[optind];
+	const char *server_ip = argv[optind + 1];
+	int server_port = atoi(argv[optind + 2]);
 	if (server_port <= 0) {
-		fprintf(stderr, "Invalid port '%s'\n", argv[3]);
+		fprintf(stderr, "Invalid port '%s'\n", argv[optind + 2]);
 		exit(EXIT_FAILURE);
 	}
 
@@ -224,15 +205,22 @@ int main(int argc, char *argv[])
 		exit(EXIT_FAILURE);
 	}
 
-	// send client ID + newline
+	// send client ID (+ the format asked for) + newline
 	char initb[32];
-	int L = snprintf(initb, sizeof initb, "%s\n", client_id);
+	int L = snprintf(initb, sizeof initb, "%s%s\n", client_id,
+					 binary ? " bin" : "");
+	if (L >= (int)sizeof initb) {
+		fprintf(stderr, "Client ID too long\n");
+		close(sockfd);
+		exit(EXIT_FAILURE);
+	}
 	if (send(sockfd, initb, L, 0) != L) {
 		perror("send client ID");
 		close(sockfd);
 		exit(EXIT_FAILURE);
 	}
 
+	static rx_buf_t rx;
 	fd_set fds;
 	int maxfd = sockfd > STDIN_FILENO ? sockfd : STDIN_FILENO;
 
@@ -282,7 +270,8 @@ int main(int argc, char *argv[])
 
 		// Handle incoming data from server
 		if (FD_ISSET(sockfd, &fds)) {
-			int rc = handle_received_data(sockfd);
+			int rc = handle_received_data(sockfd, &rx);
+			fflush(stdout);
 			if (rc <= 0)
 				break;
 		}
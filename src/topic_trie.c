@@ -1,11 +1,52 @@
 // 324CC Stefan CALMAC
 #include "../include/topic_trie.h"
+#include "../include/slab.h"
+
+#include <pthread.h>
+
+// bumped on every subscriber add/remove; cached match sets computed
+// at an older generation are stale
+static uint64_t trie_generation;
+
+// heap allocations made by this module; a warmed-up publish path must
+// leave it unchanged. Matching threads allocate too, hence atomic
+static unsigned long trie_allocs;
+
+static void *trie_malloc(size_t sz)
+{
+	__atomic_fetch_add(&trie_allocs, 1, __ATOMIC_RELAXED);
+	return malloc(sz);
+}
+
+static void *trie_calloc(size_t n, size_t sz)
+{
+	__atomic_fetch_add(&trie_allocs, 1, __ATOMIC_RELAXED);
+	return calloc(n, sz);
+}
+
+static void *trie_realloc(void *p, size_t sz)
+{
+	__atomic_fetch_add(&trie_allocs, 1, __ATOMIC_RELAXED);
+	return realloc(p, sz);
+}
+
+// typed pools for everything subscribe/unsubscribe churns through;
+// segment names live in the slab string arena
+static slab_pool_t node_pool = SLAB_POOL_INIT("node", sizeof(topic_node_t));
+static slab_pool_t sub_pool = SLAB_POOL_INIT("subscriber", sizeof(client_list_t));
+static slab_pool_t ref_pool = SLAB_POOL_INIT("sub_ref", sizeof(sub_ref_t));
+
+unsigned long trie_alloc_count(void)
+{
+	return __atomic_load_n(&trie_allocs, __ATOMIC_RELAXED) +
+		   slab_heap_allocs();
+}
 
 // is this node unused?
 int node_is_empty(topic_node_t *n)
 {
 	return n->subscribers == NULL
-		   && n->children == NULL
+		   && n->nchildren == 0
 		   && n->plus_child == NULL
 		   && n->star_child == NULL;
 }
@@ -16,21 +57,122 @@ void node_remove_if_empty(topic_node_t *root, topic_node_t *n);
 // create a node, linking it to parent
 topic_node_t *node_create(topic_node_t *parent,
 						  child_type_t ptype,
-						  const char *pname)
+						  atom_t *pname)
 {
-	topic_node_t *n = calloc(1, sizeof(*n));
+	topic_node_t *n = slab_zalloc(&node_pool);
 	if (!n)
 		return NULL;
 
 	n->parent = parent;
 	n->ptype = ptype;
-	if (ptype == CHILD_NAME && pname)
-	{
-		n->pname = strdup(pname);
-	}
+	if (ptype == CHILD_NAME)
+		n->pname = pname;
 	return n;
 }
 
+// look up the exact-match child named by atom a; interned names
+// compare by pointer
+struct child *child_find(topic_node_t *n, const atom_t *a)
+{
+	if (!a)
+		return NULL;
+
+	if (!n->table) {
+		for (unsigned int i = 0; i < n->nchildren; i++)
+			if (n->small[i].atom == a)
+				return &n->small[i];
+		return NULL;
+	}
+
+	unsigned int mask = n->child_cap - 1;
+	for (unsigned int i = a->hash & mask; n->table[i].node; i = (i + 1) & mask) {
+		if (n->table[i].atom == a)
+			return &n->table[i];
+	}
+	return NULL;
+}
+
+// place a link into a table known to have a free slot
+void child_table_put(struct child *table, unsigned int cap, struct child c)
+{
+	unsigned int mask = cap - 1;
+	unsigned int i = c.hash & mask;
+	while (table[i].node)
+		i = (i + 1) & mask;
+	table[i] = c;
+}
+
+// (re)build the hash table with `cap` slots from the current children
+int child_table_grow(topic_node_t *n, unsigned int cap)
+{
+	struct child *table = trie_calloc(cap, sizeof(*table));
+	if (!table)
+		return -1;
+
+	if (n->table) {
+		for (unsigned int i = 0; i < n->child_cap; i++)
+			if (n->table[i].node)
+				child_table_put(table, cap, n->table[i]);
+		free(n->table);
+	} else {
+		for (unsigned int i = 0; i < n->nchildren; i++)
+			child_table_put(table, cap, n->small[i]);
+	}
+	n->table = table;
+	n->child_cap = cap;
+	return 0;
+}
+
+// link a new exact-match child, switching to / growing the hash table
+// when the inline array is full or the table passes 3/4 load
+int child_insert(topic_node_t *n, struct child c)
+{
+	if (!n->table && n->nchildren < CHILD_INLINE) {
+		n->small[n->nchildren++] = c;
+		return 0;
+	}
+
+	if (!n->table) {
+		if (child_table_grow(n, CHILD_TABLE_INIT) < 0)
+			return -1;
+	} else if ((n->nchildren + 1) * 4 > n->child_cap * 3) {
+		if (child_table_grow(n, n->child_cap * 2) < 0)
+			return -1;
+	}
+	child_table_put(n->table, n->child_cap, c);
+	n->nchildren++;
+	return 0;
+}
+
+// unlink the given child entry (which must belong to n), dropping its
+// name reference
+void child_remove(topic_node_t *n, struct child *c)
+{
+	atom_release(c->atom);
+	n->nchildren--;
+
+	if (!n->table) {
+		// keep the inline array dense
+		*c = n->small[n->nchildren];
+		n->small[n->nchildren].node = NULL;
+		return;
+	}
+
+	// backward-shift deletion keeps linear probe chains intact
+	unsigned int mask = n->child_cap - 1;
+	unsigned int i = c - n->table;
+	for (unsigned int j = (i + 1) & mask; n->table[j].node; j = (j + 1) & mask) {
+		unsigned int k = n->table[j].hash & mask;
+		// leave entries whose home slot lies cyclically in (i, j]
+		if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+			continue;
+		n->table[i] = n->table[j];
+		i = j;
+	}
+	n->table[i].node = NULL;
+	n->table[i].atom = NULL;
+}
+
 // unlink & free n if empty, then recurse to parent
 void node_remove_if_empty(topic_node_t *root, topic_node_t *n)
 {
@@ -39,16 +181,10 @@ void node_remove_if_empty(topic_node_t *root, topic_node_t *n)
 
 	topic_node_t *p = n->parent;
 	if (n->ptype == CHILD_NAME) {
-		// unlink from parent's children list
-		struct child **prev = &p->children;
-		for (struct child *c = p->children; c; prev = &c->next, c = c->next) {
-			if (c->node == n) {
-				*prev = c->next;
-				free(c->name);
-				free(c);
-				break;
-			}
-		}
+		// unlink from parent's children
+		struct child *c = child_find(p, n->pname);
+		if (c && c->node == n)
+			child_remove(p, c);
 	}
 	else if (n->ptype == CHILD_PLUS) {
 		p->plus_child = NULL;
@@ -56,132 +192,179 @@ void node_remove_if_empty(topic_node_t *root, topic_node_t *n)
 	else if (n->ptype == CHILD_STAR) {
 		p->star_child = NULL;
 	}
-	free(n->pname);
-	free(n);
+	free(n->table);
+	slab_free(&node_pool, n);
 	// try parent
 	node_remove_if_empty(root, p);
 }
 
-// find or create an exact‐match child
+// find or create the exact‐match child named by span sp of str
 topic_node_t *get_or_create_child(topic_node_t *parent,
-								  const char *name)
+								  const char *str,
+								  const seg_span_t *sp)
 {
-	for (struct child *c = parent->children; c; c = c->next) {
-		if (strcmp(c->name, name) == 0)
-			return c->node;
+	atom_t *a = atom_intern(str + sp->off, sp->len, sp->hash);
+	if (!a)
+		return NULL;
+
+	struct child *found = child_find(parent, a);
+	if (found) {
+		atom_release(a);
+		return found->node;
 	}
-	struct child *c = malloc(sizeof(*c));
-	if (!c)
+
+	struct child c = {.atom = a, .hash = a->hash};
+	c.node = node_create(parent, CHILD_NAME, a);
+	if (!c.node || child_insert(parent, c) < 0) {
+		slab_free(&node_pool, c.node);
+		atom_release(a);
 		return NULL;
+	}
+	return c.node;
+}
+
+// find or create parent's child of the given kind; a named one is
+// named by span sp of str
+topic_node_t *node_child(topic_node_t *parent, child_type_t ptype,
+						 const char *str, const seg_span_t *sp)
+{
+	if (ptype == CHILD_NAME)
+		return get_or_create_child(parent, str, sp);
+
+	topic_node_t **link = ptype == CHILD_PLUS ? &parent->plus_child
+											  : &parent->star_child;
+	if (!*link)
+		*link = node_create(parent, ptype, NULL);
+	return *link;
+}
 
-	c->name = strdup(name);
-	c->node = node_create(parent, CHILD_NAME, name);
-	c->next = parent->children;
-	parent->children = c;
-	return c->node;
+// size n's child table for count named children up front, so adding
+// them never rehashes
+int node_reserve_children(topic_node_t *n, unsigned int count)
+{
+	if (!n->table && count <= CHILD_INLINE)
+		return 0;
+
+	unsigned long cap = n->table ? n->child_cap : CHILD_TABLE_INIT;
+	while ((unsigned long)count * 4 > cap * 3)
+		cap *= 2;
+	if (n->table && cap == n->child_cap)
+		return 0;
+	return child_table_grow(n, cap);
 }
 
 // add client to node->subscribers and track in client
-int node_add_subscriber(topic_node_t *n, client_t *cl)
+int node_add_subscriber(topic_node_t *n, client_t *cl, bool sf,
+						const value_filter_t *filter)
 {
 	// allocate subscriber list entry
-	client_list_t *e = malloc(sizeof(*e));
+	client_list_t *e = slab_alloc(&sub_pool);
 	if (!e) {
 		return -1;
 	}
 	e->cl = cl;
+	e->sf = sf;
+	e->filtered = filter != NULL;
+	if (filter)
+		e->filter = *filter;
 	e->next = n->subscribers;
 	n->subscribers = e;
 
 	// allocate subscription back‐reference
-	sub_ref_t *r = malloc(sizeof(*r));
+	sub_ref_t *r = slab_alloc(&ref_pool);
 	if (!r) {
 		// rollback the first link
 		n->subscribers = e->next;
-		free(e);
+		slab_free(&sub_pool, e);
 		return -1;
 	}
 	r->node = n;
 	r->next = cl->subscriptions;
 	cl->subscriptions = r;
 
+	trie_generation++;
 	return 0;
 }
 
-// subscribe client to pattern (e.g. "a/+/b/*")
-int trie_subscribe(topic_node_t *root, client_t *cl, const char *pattern)
+int topic_tokenize(const char *topic, size_t len, seg_span_t *spans, int max)
 {
-	// duplicate the pattern so strtok() can modify it
-	char *dup = strdup(pattern);
-	if (!dup) {
-		perror("strdup");
-		return -1;
+	int n = 0;
+	size_t i = 0;
+	while (i < len) {
+		// empty segments ("a//b", leading or trailing '/') are skipped
+		if (topic[i] == '/') {
+			i++;
+			continue;
+		}
+		if (n == max)
+			return -1;
+
+		uint32_t h = 2166136261u;
+		size_t start = i;
+		for (; i < len && topic[i] != '/'; i++) {
+			h ^= (uint8_t)topic[i];
+			h *= 16777619u;
+		}
+		spans[n].off = start;
+		spans[n].len = i - start;
+		spans[n].hash = h;
+		n++;
 	}
+	return n;
+}
 
+// is span s of str the single-character wildcard w?
+static inline bool span_is(const char *str, const seg_span_t *s, char w)
+{
+	return s->len == 1 && str[s->off] == w;
+}
+
+// subscribe client to pattern (e.g. "a/+/b/*"); caller holds the
+// trie for writing
+int trie_subscribe_locked(topic_node_t *root, client_t *cl,
+						  const char *pattern, bool sf,
+						  const value_filter_t *filter)
+{
 	// split on '/'
-	char *parts[64];
-	int np = 0;
-	char *tok;
-	for (tok = strtok(dup, "/");
-		 tok && np < 64;
-		 tok = strtok(NULL, "/")) {
-		parts[np++] = tok;
-	}
-	if (tok) {
+	seg_span_t parts[MAX_TOPIC_LEVELS];
+	int np = topic_tokenize(pattern, strlen(pattern), parts, MAX_TOPIC_LEVELS);
+	if (np < 0) {
 		// too many segments
-		fprintf(stderr, "Pattern has more than %d segments\n", 64);
-		free(dup);
+		fprintf(stderr, "Pattern has more than %d segments\n",
+				MAX_TOPIC_LEVELS);
 		return -1;
 	}
 
 	// walk/create the path in the trie
 	topic_node_t *cur = root;
 	for (int i = 0; i < np; i++) {
-		topic_node_t *next = NULL;
-
-		if (strcmp(parts[i], "+") == 0) {
-			if (!cur->plus_child) {
-				next = node_create(cur, CHILD_PLUS, NULL);
-				if (!next) {
-					perror("node_create(+)");
-					free(dup);
-					return -1;
-				}
-				cur->plus_child = next;
-			} else {
-				next = cur->plus_child;
-			}
-		} else if (strcmp(parts[i], "*") == 0) {
-			if (!cur->star_child) {
-				next = node_create(cur, CHILD_STAR, NULL);
-				if (!next) {
-					perror("node_create(*)");
-					free(dup);
-					return -1;
-				}
-				cur->star_child = next;
-			} else {
-				next = cur->star_child;
-			}
-		} else {
-			next = get_or_create_child(cur, parts[i]);
-			if (!next) {
-				fprintf(stderr,
-						"get_or_create_child failed for \"%s\"\n",
-						parts[i]);
-				free(dup);
-				return -1;
-			}
+		child_type_t type = span_is(pattern, &parts[i], '+') ? CHILD_PLUS
+						  : span_is(pattern, &parts[i], '*') ? CHILD_STAR
+						  : CHILD_NAME;
+		topic_node_t *next = node_child(cur, type, pattern, &parts[i]);
+		if (!next) {
+			fprintf(stderr, "node_child failed for \"%.*s\"\n",
+					(int)parts[i].len, pattern + parts[i].off);
+			return -1;
 		}
-
 		cur = next;
 	}
 
-	// attach subscriber
-	int add_ret = node_add_subscriber(cur, cl);
-	free(dup);
+	// the same condition again only updates the store-and-forward flag;
+	// a different one is one more row, see take_subscribers
+	for (client_list_t *e = cur->subscribers; e; e = e->next) {
+		if (e->cl != cl || e->filtered != (filter != NULL) ||
+			(filter && (e->filter.type != filter->type ||
+						e->filter.op != filter->op ||
+						e->filter.value != filter->value)))
+			continue;
+		e->sf = sf;
+		trie_generation++;
+		return 0;
+	}
 
-	if (add_ret != 0) {
+	// attach subscriber
+	if (node_add_subscriber(cur, cl, sf, filter) != 0) {
 		fprintf(stderr, "node_add_subscriber failed\n");
 		return -1;
 	}
@@ -199,7 +382,8 @@ int remove_subscriber_from_node(topic_node_t *root,
 		if (e->cl == cl) {
 			// unlink and free this entry
 			*prev = e->next;
-			free(e);
+			slab_free(&sub_pool, e);
+			trie_generation++;
 
 			// prune the trie if this node is now empty
 			node_remove_if_empty(root, n);
@@ -210,179 +394,617 @@ int remove_subscriber_from_node(topic_node_t *root,
 	return -1;
 }
 
-// unsubscribe client from exactly this pattern
-int trie_unsubscribe(topic_node_t *root, client_t *cl, const char *pattern)
+// unsubscribe client from exactly this pattern; caller holds the
+// trie for writing
+int trie_unsubscribe_locked(topic_node_t *root, client_t *cl,
+							const char *pattern)
 {
 	if (!root)
 		return -1;
 
-	// duplicate the pattern for strtok
-	char *dup = strdup(pattern);
-	if (!dup) {
-		perror("strdup");
-		return -1;
-	}
-
 	// split on '/'
-	char *parts[64];
-	int np = 0;
-	char *tok;
-	for (tok = strtok(dup, "/");
-		 tok && np < 64;
-		 tok = strtok(NULL, "/")) {
-		parts[np++] = tok;
-	}
-	if (tok) {
-		fprintf(stderr, "Pattern has more than %d segments\n", 64);
-		free(dup);
+	seg_span_t parts[MAX_TOPIC_LEVELS];
+	int np = topic_tokenize(pattern, strlen(pattern), parts, MAX_TOPIC_LEVELS);
+	if (np < 0) {
+		fprintf(stderr, "Pattern has more than %d segments\n",
+				MAX_TOPIC_LEVELS);
 		return -1;
 	}
 
 	// walk the trie (but don't create new nodes)
 	topic_node_t *cur = root;
 	for (int i = 0; i < np; i++) {
-		if (strcmp(parts[i], "+") == 0) {
+		const seg_span_t *sp = &parts[i];
+		if (span_is(pattern, sp, '+')) {
 			cur = cur->plus_child;
-		} else if (strcmp(parts[i], "*") == 0) {
+		} else if (span_is(pattern, sp, '*')) {
 			cur = cur->star_child;
 		} else {
-			struct child *found = NULL;
-			for (struct child *c = cur->children; c; c = c->next) {
-				if (strcmp(c->name, parts[i]) == 0) {
-					found = c;
-					break;
-				}
-			}
+			struct child *found =
+				child_find(cur, atom_lookup(pattern + sp->off,
+											sp->len, sp->hash));
 			cur = found ? found->node : NULL;
 		}
 		if (!cur) {
 			// pattern not in trie
-			free(dup);
 			return -1;
 		}
 	}
-	free(dup);
 
-	// remove the client from this node's subscriber list
-	if (remove_subscriber_from_node(root, cur, cl) < 0) {
-		fprintf(stderr, "remove_subscriber_from_node failed\n");
-		return -1;
-	}
-
-	// remove the corresponding back‐reference from cl->subscriptions
+	// every condition the client has here goes: drop the back-references
+	// first, since removing the last entry may prune cur
+	unsigned int refs = 0;
 	sub_ref_t **rprev = &cl->subscriptions;
-	int found_ref = 0;
-	for (sub_ref_t *r = cl->subscriptions; r; r = r->next) {
+	for (sub_ref_t *r = cl->subscriptions; r; r = *rprev) {
 		if (r->node == cur) {
 			*rprev = r->next;
-			free(r);
-			found_ref = 1;
-			break;
+			slab_free(&ref_pool, r);
+			refs++;
+		} else {
+			rprev = &r->next;
 		}
-		rprev = &r->next;
 	}
-	if (!found_ref) {
+
+	// remove the client's entries from this node's subscriber list, one
+	// per back-reference (at least one)
+	unsigned int i = 0;
+	do {
+		if (remove_subscriber_from_node(root, cur, cl) < 0) {
+			fprintf(stderr, "remove_subscriber_from_node failed\n");
+			return -1;
+		}
+	} while (++i < refs);
+
+	if (!refs) {
 		fprintf(stderr,
 				"Warning: subscription reference for '%s' not found\n",
 				pattern);
 	}
+	return 0;
+}
 
+// append to a recipient vector, doubling its capacity when full
+int client_vec_push(client_vec_t *v, client_t *cl, bool sf,
+					const value_filter_t *filter, bool multi)
+{
+	if (v->n == v->cap) {
+		size_t cap = v->cap ? v->cap * 2 : 64;
+		recipient_t *nv = trie_realloc(v->v, cap * sizeof(*nv));
+		if (!nv)
+			return -1;
+		v->v = nv;
+		v->cap = cap;
+	}
+	v->v[v->n++] = (recipient_t){
+		.cl = cl, .filter = filter, .sf = sf, .multi = multi};
 	return 0;
 }
 
-// recursive collect for publish
-void collect(topic_node_t *n, char **T, int N, int idx,
-			 client_list_t **out)
+// — match contexts —
+// Everything a match writes lives in the matching thread's context, so
+// ingest threads can match concurrently without touching shared memory
+// beyond the frames they queue.
+
+typedef struct match_entry {
+	struct match_entry *hnext;		// bucket chain
+	struct match_entry *cnext;		// CLOCK ring
+	struct match_entry *cprev;
+	uint64_t gen;
+	uint32_t hash;
+	bool referenced;				// CLOCK second-chance bit
+	size_t n;
+	uint32_t tlen;
+	char topic[MAX_TOPIC_LEN];		// not NUL-terminated
+	recipient_t rcpt[];
+} match_entry_t;
+
+// topic -> deduplicated recipients, see "publish match cache" below
+typedef struct match_cache {
+	size_t bytes;
+	match_entry_t *buckets[MATCH_CACHE_BUCKETS];
+	match_entry_t *hand;
+	unsigned long entries;
+	unsigned long hits, misses, evictions;
+} match_cache_t;
+
+// open-addressing set of (key, idx) pairs; a slot only counts if it
+// carries the current match number, so bumping it empties the set
+typedef struct stamp_slot {
+	const void *key;
+	uint32_t idx;
+	uint32_t pos;					// taken: the client's place in the match
+	uint64_t seq;
+} stamp_slot_t;
+
+// a taken client with no place yet: its push ran out of memory
+#define POS_NONE UINT32_MAX
+
+typedef struct stamp_set {
+	stamp_slot_t *slots;
+	size_t cap;						// power of two
+	size_t used;					// slots of match `seq`
+	uint64_t seq;
+} stamp_set_t;
+
+struct match_ctx {
+	// held across a whole publish; writers take every context's lock
+	pthread_mutex_t lock;
+	unsigned int slot;
+	uint64_t seq;					// current match
+	stamp_set_t visited;			// (node, level) states walked
+	stamp_set_t taken;				// clients already matched
+	client_vec_t matched;			// reused across publishes
+	match_cache_t cache;
+	unsigned long seg_lookups, seg_hits;
+	unsigned long filtered;			// deliveries a filter held back
+};
+
+// every byte budget applies per context; 0 disables the caches
+static size_t cache_budget = DEFAULT_MATCH_CACHE_BYTES;
+
+static match_ctx_t main_ctx = {.lock = PTHREAD_MUTEX_INITIALIZER};
+static match_ctx_t *ctxs[MAX_MATCH_CTX] = {&main_ctx};
+static unsigned int nctx = 1;
+static __thread match_ctx_t *cur_ctx = &main_ctx;
+
+// only called while no other thread runs matches yet
+match_ctx_t *match_ctx_create(void)
 {
-	if (!n)
-		return;
+	if (nctx == MAX_MATCH_CTX)
+		return NULL;
+	match_ctx_t *ctx = calloc(1, sizeof(*ctx));
+	if (!ctx)
+		return NULL;
+	pthread_mutex_init(&ctx->lock, NULL);
+	ctx->slot = nctx;
+	ctxs[nctx++] = ctx;
+	return ctx;
+}
+
+void match_ctx_enter(match_ctx_t *ctx)
+{
+	cur_ctx = ctx;
+}
+
+// Subscription changes exclude every publish: each context's lock is
+// only ever contended by the (rare) writer, so publishing threads do
+// not share a lock word the way they would with one rwlock
+void trie_write_lock(void)
+{
+	for (unsigned int i = 0; i < nctx; i++)
+		pthread_mutex_lock(&ctxs[i]->lock);
+}
+
+void trie_write_unlock(void)
+{
+	for (unsigned int i = nctx; i-- > 0;)
+		pthread_mutex_unlock(&ctxs[i]->lock);
+}
 
-	// '*' at this node can match zero levels
-	if (n->star_child) {
-		for (client_list_t *e = n->star_child->subscribers; e; e = e->next) {
-			client_list_t *c = malloc(sizeof(*c));
-			c->cl = e->cl;
-			c->next = *out;
-			*out = c;
+// Fibonacci hashing; the high half of the product is the well mixed
+// one (node and client addresses share their low bits)
+static inline size_t stamp_hash(const void *key, uint32_t idx)
+{
+	uint64_t h = ((uintptr_t)key + idx) * 0x9E3779B97F4A7C15ull;
+	return h >> 32;
+}
+
+// double the table, keeping the current match's pairs
+int stamp_set_grow(stamp_set_t *s)
+{
+	size_t cap = s->cap ? s->cap * 2 : STAMP_SET_INIT;
+	stamp_slot_t *slots = trie_calloc(cap, sizeof(*slots));
+	if (!slots)
+		return -1;
+
+	for (size_t i = 0; i < s->cap; i++) {
+		stamp_slot_t *o = &s->slots[i];
+		if (o->seq != s->seq)
+			continue;
+		size_t j = stamp_hash(o->key, o->idx) & (cap - 1);
+		while (slots[j].seq == s->seq)
+			j = (j + 1) & (cap - 1);
+		slots[j] = *o;
+	}
+	free(s->slots);
+	s->slots = slots;
+	s->cap = cap;
+	return 0;
+}
+
+// add (key, idx) to the set of match seq; false if it was already in.
+// *slot (if asked for) gets the pair's slot, NULL when out of memory
+static bool stamp_set_add(stamp_set_t *s, uint64_t seq,
+						  const void *key, uint32_t idx,
+						  stamp_slot_t **slot)
+{
+	if (slot)
+		*slot = NULL;
+	if (s->seq != seq) {
+		s->seq = seq;
+		s->used = 0;
+	}
+	// out of memory: say "new", i.e. fall back to no memoization
+	if ((s->used + 1) * 2 > s->cap && stamp_set_grow(s) < 0)
+		return true;
+
+	size_t mask = s->cap - 1;
+	for (size_t i = stamp_hash(key, idx) & mask;; i = (i + 1) & mask) {
+		stamp_slot_t *sl = &s->slots[i];
+		bool fresh = sl->seq != seq;
+		if (fresh) {
+			sl->key = key;
+			sl->idx = idx;
+			sl->seq = seq;
+			s->used++;
+		} else if (sl->key != key || sl->idx != idx) {
+			continue;
 		}
-		// or eat levels
-		for (int j = idx; j < N; j++)
-			collect(n->star_child, T, N, j, out);
+		if (slot)
+			*slot = sl;
+		return fresh;
 	}
+}
 
-	if (idx == N) {
-		for (client_list_t *e = n->subscribers; e; e = e->next) {
-			client_list_t *c = malloc(sizeof(*c));
-			c->cl = e->cl;
-			c->next = *out;
-			*out = c;
+// add the subscribers of one node to the current match, skipping
+// clients already taken; a client matched again through a
+// store-and-forward subscription becomes a store-and-forward recipient,
+// through an unconditional one an unconditional recipient, and through
+// another conditional one gets a row for that condition too
+static void take_subscribers(match_ctx_t *ctx, client_list_t *l,
+							 client_vec_t *out)
+{
+	for (client_list_t *e = l; e; e = e->next) {
+		const value_filter_t *f = e->filtered ? &e->filter : NULL;
+		stamp_slot_t *sl;
+		if (stamp_set_add(&ctx->taken, ctx->seq, e->cl, 0, &sl) ||
+			sl->pos == POS_NONE) {
+			// the slot stays (clearing it would cut probe chains), but
+			// with no place a later row of the client pushes it again
+			int ret = client_vec_push(out, e->cl, e->sf, f, false);
+			if (sl)
+				sl->pos = ret < 0 ? POS_NONE : out->n - 1;
+			continue;
+		}
+		if (sl->pos >= out->n)
+			continue;
+		recipient_t *r = &out->v[sl->pos];
+		r->sf |= e->sf;
+		if (!r->filter) {
+			continue;
+		} else if (!f) {
+			r->filter = NULL;
+		} else {
+			r->multi = true;
+			client_vec_push(out, e->cl, e->sf, f, true);
 		}
-		return;
 	}
+}
 
-	// exact children
-	for (struct child *c = n->children; c; c = c->next) {
-		if (strcmp(c->name, T[idx]) == 0)
-			collect(c->node, T, N, idx + 1, out);
+// recursive collect for publish; A[i] is the atom of segment i (NULL
+// if no link is named like it). Matches are appended, deduplicated, to
+// out, which only allocates when it grows.
+// Every (node, idx) state is walked at most once per match, so stacked
+// '*' wildcards cost O(nodes * levels) instead of one walk per way of
+// splitting the topic between them
+void collect(match_ctx_t *ctx, topic_node_t *n, atom_t **A, int N, int idx,
+			 client_vec_t *out)
+{
+	if (!n || !stamp_set_add(&ctx->visited, ctx->seq, n, idx, NULL))
+		return;
+
+	// a '*' node is entered matching zero levels and loops on
+	// itself to eat each further one
+	if (n->ptype == CHILD_STAR && idx < N)
+		collect(ctx, n, A, N, idx + 1, out);
+	if (n->star_child)
+		collect(ctx, n->star_child, A, N, idx, out);
+
+	if (idx == N) {
+		take_subscribers(ctx, n->subscribers, out);
+		return;
 	}
+
+	// exact child
+	struct child *c = child_find(n, A[idx]);
+	if (c)
+		collect(ctx, c->node, A, N, idx + 1, out);
 	// '+' wildcard
 	if (n->plus_child)
-		collect(n->plus_child, T, N, idx + 1, out);
+		collect(ctx, n->plus_child, A, N, idx + 1, out);
+}
+
+// — publish match cache —
+// topic -> deduplicated recipients, bounded by a byte budget and
+// evicted with CLOCK; entries carry the generation they were built at
+
+void trie_cache_configure(size_t budget)
+{
+	cache_budget = budget;
+}
+
+size_t cache_entry_size(size_t n)
+{
+	return sizeof(match_entry_t) + n * sizeof(recipient_t);
+}
+
+match_entry_t *cache_lookup(match_cache_t *mc, const char *topic,
+							size_t tlen, uint32_t hash)
+{
+	for (match_entry_t *e = mc->buckets[hash % MATCH_CACHE_BUCKETS];
+		 e; e = e->hnext) {
+		if (e->hash == hash && e->tlen == tlen &&
+			memcmp(e->topic, topic, tlen) == 0)
+			return e;
+	}
+	return NULL;
+}
+
+void cache_remove(match_cache_t *mc, match_entry_t *e)
+{
+	match_entry_t **pp = &mc->buckets[e->hash % MATCH_CACHE_BUCKETS];
+	while (*pp != e)
+		pp = &(*pp)->hnext;
+	*pp = e->hnext;
+
+	if (e->cnext == e) {
+		mc->hand = NULL;
+	} else {
+		e->cprev->cnext = e->cnext;
+		e->cnext->cprev = e->cprev;
+		if (mc->hand == e)
+			mc->hand = e->cnext;
+	}
+
+	mc->bytes -= cache_entry_size(e->n);
+	mc->entries--;
+	free(e);
+}
+
+// CLOCK sweep: stale entries go at once, referenced ones get a
+// second chance
+void cache_evict_one(match_cache_t *mc)
+{
+	for (;;) {
+		match_entry_t *e = mc->hand;
+		if (e->gen == trie_generation && e->referenced) {
+			e->referenced = false;
+			mc->hand = e->cnext;
+			continue;
+		}
+		cache_remove(mc, e);
+		__atomic_fetch_add(&mc->evictions, 1, __ATOMIC_RELAXED);
+		return;
+	}
+}
+
+// remember the recipients of topic, replacing a stale entry
+void cache_store(match_cache_t *mc, const char *topic, size_t tlen,
+				 uint32_t hash, const recipient_t *rcpt, size_t n)
+{
+	size_t sz = cache_entry_size(n);
+	if (sz > cache_budget || tlen > MAX_TOPIC_LEN)
+		return;
+
+	match_entry_t *old = cache_lookup(mc, topic, tlen, hash);
+	if (old)
+		cache_remove(mc, old);
+	while (mc->bytes + sz > cache_budget)
+		cache_evict_one(mc);
+
+	match_entry_t *e = trie_malloc(sz);
+	if (!e)
+		return;
+	e->gen = trie_generation;
+	e->hash = hash;
+	e->referenced = false;
+	e->n = n;
+	e->tlen = tlen;
+	memcpy(e->topic, topic, tlen);
+	memcpy(e->rcpt, rcpt, n * sizeof(*rcpt));
+
+	e->hnext = mc->buckets[hash % MATCH_CACHE_BUCKETS];
+	mc->buckets[hash % MATCH_CACHE_BUCKETS] = e;
+	// insert just behind the hand, i.e. last in sweep order
+	if (!mc->hand) {
+		e->cnext = e->cprev = e;
+		mc->hand = e;
+	} else {
+		e->cnext = mc->hand;
+		e->cprev = mc->hand->cprev;
+		e->cprev->cnext = e;
+		mc->hand->cprev = e;
+	}
+	mc->bytes += sz;
+	mc->entries++;
+}
+
+// the counters are read while their thread keeps matching: each one
+// is coherent on its own, not necessarily with the others
+void match_ctx_print_stats(const match_ctx_t *ctx)
+{
+	const match_cache_t *mc = &ctx->cache;
+	unsigned long hits = __atomic_load_n(&mc->hits, __ATOMIC_RELAXED);
+	unsigned long misses = __atomic_load_n(&mc->misses, __ATOMIC_RELAXED);
+	unsigned long segs = __atomic_load_n(&ctx->seg_lookups, __ATOMIC_RELAXED);
+	unsigned long seg_hits = __atomic_load_n(&ctx->seg_hits, __ATOMIC_RELAXED);
+	fprintf(stderr,
+			"match ctx %u: cache %lu hits, %lu misses (%.1f%% hit), "
+			"%lu entries, %zu/%zu B, %lu evictions; "
+			"segment lookups %lu/%lu hit; %lu filtered\n",
+			ctx->slot, hits, misses,
+			hits + misses ? 100.0 * hits / (hits + misses) : 0.0,
+			__atomic_load_n(&mc->entries, __ATOMIC_RELAXED),
+			__atomic_load_n(&mc->bytes, __ATOMIC_RELAXED), cache_budget,
+			__atomic_load_n(&mc->evictions, __ATOMIC_RELAXED),
+			seg_hits, segs,
+			__atomic_load_n(&ctx->filtered, __ATOMIC_RELAXED));
+}
+
+void trie_print_stats(void)
+{
+	for (unsigned int i = 0; i < nctx; i++)
+		match_ctx_print_stats(ctxs[i]);
+	fprintf(stderr, "trie: %lu heap allocations\n", trie_alloc_count());
+	slab_print_stats(&node_pool, stderr);
+	slab_print_stats(&sub_pool, stderr);
+	slab_print_stats(&ref_pool, stderr);
+	arena_print_stats(stderr);
+	atom_print_stats(stderr);
+}
+
+// walk the trie for topic[0..tlen) and dedupe the matches into out
+// (reset first), using the calling thread's match context. Returns -1
+// if the topic is deeper than MAX_TOPIC_LEVELS
+int match_topic(topic_node_t *root, const char *topic, size_t tlen,
+				client_vec_t *out)
+{
+	match_ctx_t *ctx = cur_ctx;
+	out->n = 0;
+
+	seg_span_t spans[MAX_TOPIC_LEVELS];
+	int N = topic_tokenize(topic, tlen, spans, MAX_TOPIC_LEVELS);
+	if (N < 0)
+		return -1;
+
+	atom_t *A[MAX_TOPIC_LEVELS];
+	unsigned long hits = 0;
+	for (int i = 0; i < N; i++) {
+		A[i] = atom_lookup(topic + spans[i].off, spans[i].len, spans[i].hash);
+		hits += A[i] != NULL;
+	}
+	__atomic_fetch_add(&ctx->seg_lookups, N, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&ctx->seg_hits, hits, __ATOMIC_RELAXED);
+
+	// a fresh match number empties the visited and taken sets, so
+	// dedupe and memoization stay linear
+	ctx->seq++;
+	collect(ctx, root, A, N, 0, out);
+	return 0;
 }
 
 // publish into the trie
-void trie_publish(topic_node_t *root,
-				  const char *topic,
-				  const char *buf,
-				  size_t len)
-{
-	char *dup = strdup(topic);
-	char *T[64];
-	int N = 0;
-	for (char *tok = strtok(dup, "/");
-		 tok && N < 64;
-		 tok = strtok(NULL, "/")) {
-		T[N++] = tok;
-	}
-
-	// collect matches
-	client_list_t *raw = NULL;
-	collect(root, T, N, 0, &raw);
-	free(dup);
-
-	// dedupe & send
-	client_t *seen[1024];
-	int sc = 0;
-	for (client_list_t *e = raw; e; e = e->next) {
-		client_t *cl = e->cl;
-		int dup = 0;
-		for (int i = 0; i < sc; i++)
-			if (seen[i] == cl) {
-				dup = 1;
-				break;
-			}
-		if (!dup && sc < 1024) {
-			seen[sc++] = cl;
-			send_message(cl->fd, MSG_PUBLISH, buf, len);
+void trie_publish(topic_node_t *root, publication_t *pub)
+{
+	const char *topic = pub->data;
+	size_t tlen = pub->tlen;
+	match_ctx_t *ctx = cur_ctx;
+	match_cache_t *mc = &ctx->cache;
+	const recipient_t *rcpt;
+	size_t n;
+
+	// held until every recipient has the frame queued, so a subscription
+	// change falls entirely before or after a publish: nothing matched
+	// before an unsubscribe reaches the client after its ACK
+	pthread_mutex_lock(&ctx->lock);
+
+	uint32_t hash = seg_hash(topic, tlen);
+	match_entry_t *e = cache_budget ? cache_lookup(mc, topic, tlen, hash) : NULL;
+	if (e && e->gen == trie_generation) {
+		__atomic_fetch_add(&mc->hits, 1, __ATOMIC_RELAXED);
+		e->referenced = true;
+		rcpt = e->rcpt;
+		n = e->n;
+	} else {
+		__atomic_fetch_add(&mc->misses, 1, __ATOMIC_RELAXED);
+		if (match_topic(root, topic, tlen, &ctx->matched) < 0) {
+			pthread_mutex_unlock(&ctx->lock);
+			fprintf(stderr, "Topic %.*s has more than %d levels, dropped\n",
+					(int)tlen, topic, MAX_TOPIC_LEVELS);
+			return;
 		}
+		rcpt = ctx->matched.v;
+		n = ctx->matched.n;
+		if (cache_budget)
+			cache_store(mc, topic, tlen, hash, rcpt, n);
 	}
-	// free raw list
-	while (raw) {
-		client_list_t *n = raw->next;
-		free(raw);
-		raw = n;
+
+	// the value is decoded once, for the first recipient with a filter;
+	// clients with several conditional rows are sent one copy, checked
+	// off in the taken set under a match number of their own
+	payload_value_t value;
+	bool decoded = false;
+	uint64_t sent_seq = 0;
+	unsigned long filtered = 0;
+
+	// each format is encoded once and its recipients queue a reference
+	bool storing = false;
+	for (size_t i = 0; i < n; i++) {
+		client_t *cl = rcpt[i].cl;
+		if (rcpt[i].filter) {
+			if (!decoded) {
+				size_t vlen = pub->len > MAX_TOPIC_LEN
+							? pub->len - MAX_TOPIC_LEN : 0;
+				payload_decode(pub->data + MAX_TOPIC_LEN, vlen, &value);
+				decoded = true;
+			}
+			if (!filter_match(rcpt[i].filter, &value)) {
+				filtered++;
+				continue;
+			}
+		}
+		if (rcpt[i].multi) {
+			if (!sent_seq)
+				sent_seq = ++ctx->seq;
+			if (!stamp_set_add(&ctx->taken, sent_seq, cl, 0, NULL))
+				continue;
+		}
+		if (!rcpt[i].sf) {
+			frame_t *f = publication_frame(pub, client_format(cl));
+			if (f)
+				client_send_frame(cl, f);
+			continue;
+		}
+		storing = true;
+		client_send_or_store(cl, pub);
 	}
+	if (storing)
+		client_store_end();
+	if (filtered)
+		__atomic_fetch_add(&ctx->filtered, filtered, __ATOMIC_RELAXED);
+	pthread_mutex_unlock(&ctx->lock);
 }
 
 // on client destroy, remove all its subs cleanly
 void cleanup_client_subscriptions(topic_node_t *root, client_t *cl)
 {
+	trie_write_lock();
 	sub_ref_t *r = cl->subscriptions;
 	while (r) {
 		sub_ref_t *n = r->next;
 		remove_subscriber_from_node(root, r->node, cl);
-		free(r);
+		slab_free(&ref_pool, r);
 		r = n;
 	}
 	cl->subscriptions = NULL;
+	trie_write_unlock();
+}
+
+// queued while no publish runs: after every frame matched before the
+// change, before every one matched after it
+static int send_ack(client_t *cl, frame_t *ack)
+{
+	return ack ? client_send_frame(cl, ack) : 0;
+}
+
+int trie_subscribe(topic_node_t *root, client_t *cl, const char *pattern,
+				   bool sf, const value_filter_t *filter, frame_t *ack)
+{
+	trie_write_lock();
+	int ret = trie_subscribe_locked(root, cl, pattern, sf, filter);
+	if (ret == 0)
+		ret = send_ack(cl, ack);
+	trie_write_unlock();
+	return ret;
+}
+
+int trie_unsubscribe(topic_node_t *root, client_t *cl, const char *pattern,
+					 frame_t *ack)
+{
+	trie_write_lock();
+	int ret = trie_unsubscribe_locked(root, cl, pattern);
+	if (ret == 0)
+		ret = send_ack(cl, ack);
+	trie_write_unlock();
+	return ret;
 }
@@ -0,0 +1,287 @@
+// 324CC Stefan CALMAC
+#define _GNU_SOURCE // sched_yield
+#include "../include/worker.h"
+
+#include <sched.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+
+#define WORKER_EVENTS 64
+
+static worker_t *workers;
+static unsigned int nworkers;
+static unsigned int next_worker;
+
+// wake w if it is (about to be) parked in epoll_wait
+static void worker_wake(worker_t *w)
+{
+	if (__atomic_exchange_n(&w->sleeping, 0, __ATOMIC_SEQ_CST)) {
+		uint64_t one = 1;
+		if (write(w->evfd, &one, sizeof(one)) < 0 && errno != EAGAIN)
+			perror("write eventfd");
+	}
+}
+
+void worker_push(worker_t *w, work_op_t op, client_t *c, int fd, frame_t *f)
+{
+	uint64_t pos = __atomic_load_n(&w->tail, __ATOMIC_RELAXED);
+	work_item_t *it;
+
+	for (;;) {
+		it = &w->q[pos & (WORK_QUEUE_SIZE - 1)];
+		uint64_t seq = __atomic_load_n(&it->seq, __ATOMIC_ACQUIRE);
+		int64_t dif = (int64_t)(seq - pos);
+
+		if (dif == 0) {
+			// slot is free for this turn: claim it
+			if (__atomic_compare_exchange_n(&w->tail, &pos, pos + 1, true,
+											__ATOMIC_RELAXED,
+											__ATOMIC_RELAXED))
+				break;
+		} else if (dif < 0) {
+			// full: the worker is a whole lap behind
+			__atomic_fetch_add(&w->full_waits, 1, __ATOMIC_RELAXED);
+			worker_wake(w);
+			sched_yield();
+			pos = __atomic_load_n(&w->tail, __ATOMIC_RELAXED);
+		} else {
+			// another producer took it
+			pos = __atomic_load_n(&w->tail, __ATOMIC_RELAXED);
+		}
+	}
+
+	it->op = op;
+	it->fd = fd;
+	it->c = c;
+	it->f = f ? frame_ref(f) : NULL;
+	__atomic_store_n(&it->seq, pos + 1, __ATOMIC_RELEASE);
+
+	// pairs with the fence in worker_main: either the worker sees the
+	// item before parking, or we see it parked and ring
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	worker_wake(w);
+}
+
+// take the next item, false if the ring is empty
+static bool worker_pop(worker_t *w, work_item_t *out)
+{
+	work_item_t *it = &w->q[w->head & (WORK_QUEUE_SIZE - 1)];
+	if (__atomic_load_n(&it->seq, __ATOMIC_ACQUIRE) != w->head + 1)
+		return false;
+
+	*out = *it;
+	// hand the slot back for the producers' next lap
+	__atomic_store_n(&it->seq, w->head + WORK_QUEUE_SIZE, __ATOMIC_RELEASE);
+	w->head++;
+	return true;
+}
+
+// remember to flush c once the current batch is applied
+static void mark_dirty(worker_t *w, client_t *c)
+{
+	if (c->flush_pending)
+		return;
+	c->flush_pending = true;
+	c->flush_next = w->dirty;
+	w->dirty = c;
+}
+
+// apply one item; returns true on WORK_STOP
+static bool worker_apply(worker_t *w, work_item_t *it)
+{
+	client_t *c = it->c;
+
+	switch (it->op) {
+	case WORK_FRAME:
+		if (client_queue_frame(c, it->f) == 0 && c->out_count)
+			mark_dirty(w, c);
+		frame_release(it->f);
+		break;
+
+	case WORK_ATTACH: {
+		struct epoll_event ev = {.events = EPOLLONESHOT, .data.ptr = c};
+		if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, it->fd, &ev) < 0) {
+			// can't watch it for output: have the reactor drop it
+			perror("epoll_ctl ADD worker");
+			shutdown(it->fd, SHUT_RDWR);
+		}
+		client_out_attach(c, it->fd, w->epfd);
+		break;
+	}
+
+	case WORK_REPLAY:
+		client_replay(c);
+		break;
+
+	case WORK_DETACH:
+		client_out_close(c);
+		break;
+
+	case WORK_STOP:
+		return true;
+	}
+	return false;
+}
+
+// write out everything the last batch queued, one sendmsg per client
+static void worker_flush_dirty(worker_t *w)
+{
+	while (w->dirty) {
+		client_t *c = w->dirty;
+		w->dirty = c->flush_next;
+		c->flush_pending = false;
+
+		// with EPOLLOUT armed the socket is full anyway, wait for it
+		if (c->out_fd >= 0 && !c->closing && !c->want_out &&
+			client_flush(c) < 0)
+			client_kick(c);
+	}
+}
+
+static void *worker_main(void *arg)
+{
+	worker_t *w = arg;
+	struct epoll_event events[WORKER_EVENTS];
+	bool stop = false;
+
+	while (!stop) {
+		// apply a bounded batch so sockets get flushed regularly
+		work_item_t it;
+		unsigned int n = 0;
+		while (n < WORK_BATCH && worker_pop(w, &it)) {
+			n++;
+			if (worker_apply(w, &it)) {
+				stop = true;
+				break;
+			}
+		}
+		__atomic_fetch_add(&w->items, n, __ATOMIC_RELAXED);
+		worker_flush_dirty(w);
+		if (stop)
+			break;
+
+		// park unless there is more to do; see worker_push
+		int timeout = 0;
+		if (n < WORK_BATCH) {
+			__atomic_store_n(&w->sleeping, 1, __ATOMIC_SEQ_CST);
+			__atomic_thread_fence(__ATOMIC_SEQ_CST);
+			work_item_t *next = &w->q[w->head & (WORK_QUEUE_SIZE - 1)];
+			if (__atomic_load_n(&next->seq, __ATOMIC_ACQUIRE) != w->head + 1)
+				timeout = -1;
+		}
+
+		int nev = epoll_wait(w->epfd, events, WORKER_EVENTS, timeout);
+		__atomic_store_n(&w->sleeping, 0, __ATOMIC_RELAXED);
+		if (timeout < 0)
+			__atomic_fetch_add(&w->wakeups, 1, __ATOMIC_RELAXED);
+		if (nev < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("epoll_wait worker");
+			break;
+		}
+
+		for (int i = 0; i < nev; i++) {
+			if (events[i].data.ptr == &w->evfd) {
+				uint64_t cnt;
+				if (read(w->evfd, &cnt, sizeof(cnt)) < 0 && errno != EAGAIN)
+					perror("read eventfd");
+				continue;
+			}
+
+			// one-shot writability: disarmed now, client_flush re-arms
+			client_t *c = events[i].data.ptr;
+			c->want_out = false;
+			if (c->out_fd < 0 || c->closing)
+				continue;
+			if (client_flush(c) < 0)
+				client_kick(c);
+			else if (c->replaying)
+				client_replay(c);
+		}
+	}
+	return NULL;
+}
+
+int worker_init(worker_t *w, unsigned int index)
+{
+	memset(w, 0, sizeof(*w));
+	w->index = index;
+	w->q = malloc(WORK_QUEUE_SIZE * sizeof(*w->q));
+	if (!w->q)
+		return -1;
+	for (uint64_t i = 0; i < WORK_QUEUE_SIZE; i++)
+		w->q[i].seq = i;
+
+	w->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (w->epfd < 0)
+		return -1;
+	w->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (w->evfd < 0)
+		return -1;
+
+	struct epoll_event ev = {.events = EPOLLIN, .data.ptr = &w->evfd};
+	if (epoll_ctl(w->epfd, EPOLL_CTL_ADD, w->evfd, &ev) < 0)
+		return -1;
+	return 0;
+}
+
+int workers_start(unsigned int k)
+{
+	workers = calloc(k, sizeof(*workers));
+	if (!workers)
+		return -1;
+
+	for (unsigned int i = 0; i < k; i++) {
+		if (worker_init(&workers[i], i) < 0) {
+			perror("worker_init");
+			return -1;
+		}
+		int err = pthread_create(&workers[i].tid, NULL, worker_main,
+								 &workers[i]);
+		if (err) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(err));
+			return -1;
+		}
+		nworkers++;
+	}
+	return 0;
+}
+
+void workers_stop(void)
+{
+	for (unsigned int i = 0; i < nworkers; i++)
+		worker_push(&workers[i], WORK_STOP, NULL, -1, NULL);
+	for (unsigned int i = 0; i < nworkers; i++) {
+		pthread_join(workers[i].tid, NULL);
+		close(workers[i].evfd);
+		close(workers[i].epfd);
+		free(workers[i].q);
+	}
+	free(workers);
+	workers = NULL;
+	nworkers = 0;
+}
+
+worker_t *worker_pick(void)
+{
+	if (!nworkers)
+		return NULL;
+	worker_t *w = &workers[next_worker++ % nworkers];
+	w->clients++;
+	return w;
+}
+
+void workers_print_stats(void)
+{
+	for (unsigned int i = 0; i < nworkers; i++) {
+		worker_t *w = &workers[i];
+		fprintf(stderr,
+				"worker %u: %u clients, %lu items, %lu wakeups, "
+				"%lu full-ring waits\n",
+				w->index, w->clients,
+				__atomic_load_n(&w->items, __ATOMIC_RELAXED),
+				__atomic_load_n(&w->wakeups, __ATOMIC_RELAXED),
+				__atomic_load_n(&w->full_waits, __ATOMIC_RELAXED));
+	}
+}